@@ -0,0 +1,53 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "backoff.h"
+
+#include <QRandomGenerator>
+#include <algorithm>
+
+Backoff::Backoff( std::chrono::milliseconds base, std::chrono::milliseconds cap )
+  : m_base( base )
+  , m_cap( std::max( base, cap ) )
+{
+}
+
+std::chrono::milliseconds Backoff::next()
+{
+  // stop doubling once the cap is reached, the shift would overflow eventually
+  qint64 step = m_base.count();
+  for ( int i = 0; i < m_attempts && step < m_cap.count(); ++i )
+    step *= 2;
+  step = std::min<qint64>( step, m_cap.count() );
+  ++m_attempts;
+
+  const qint64 half = step / 2;
+  return std::chrono::milliseconds( half + QRandomGenerator::global()->bounded( step - half + 1 ) );
+}
+
+void Backoff::reset()
+{
+  m_attempts = 0;
+}
+
+int Backoff::attempts() const
+{
+  return m_attempts;
+}
@@ -0,0 +1,48 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include <chrono>
+
+/*!
+  Exponential backoff with jitter for retrying requests to the Neato cloud.
+
+  Every delay lies between half and all of the current step, so a fleet of
+  gateways that failed together does not come back in lockstep.
+*/
+class Backoff
+{
+public:
+  explicit Backoff( std::chrono::milliseconds base = std::chrono::seconds(1), std::chrono::milliseconds cap = std::chrono::minutes(5) );
+
+  // delay before the next attempt, doubles with every call up to the cap
+  std::chrono::milliseconds next();
+  void reset();
+  int attempts() const;
+
+private:
+  std::chrono::milliseconds m_base;
+  std::chrono::milliseconds m_cap;
+  int m_attempts = 0;
+};
+
+#endif // BACKOFF_H
@@ -0,0 +1,96 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "bringupqueue.h"
+#include "extern-plugininfo.h"
+
+#include <QTimer>
+#include <algorithm>
+
+using namespace std::chrono_literals;
+
+namespace {
+  // an account that neither authenticated nor failed by then gives up its slot
+  constexpr std::chrono::milliseconds slotTimeout = 30s;
+}
+
+BringUpQueue::BringUpQueue( int concurrency, QObject *parent )
+  : QObject{parent}
+  , m_concurrency( std::max( 1, concurrency ) )
+{
+}
+
+void BringUpQueue::enqueue( const ThingId &accountId, qint64 rank, const Start &start )
+{
+  remove( accountId );
+
+  const auto pos = std::find_if( m_queued.begin(), m_queued.end(), [rank]( const Entry &e ) { return e.rank < rank; } );
+  m_queued.insert( pos, Entry{ accountId, rank, start } );
+  schedulePump();
+}
+
+void BringUpQueue::finish( const ThingId &accountId )
+{
+  if ( !m_running.remove( accountId ) )
+    return;
+  schedulePump();
+}
+
+void BringUpQueue::remove( const ThingId &accountId )
+{
+  m_queued.erase( std::remove_if( m_queued.begin(), m_queued.end(), [&accountId]( const Entry &e ) { return e.accountId == accountId; } ), m_queued.end() );
+  finish( accountId );
+}
+
+bool BringUpQueue::contains( const ThingId &accountId ) const
+{
+  return m_running.contains( accountId )
+      || std::any_of( m_queued.cbegin(), m_queued.cend(), [&accountId]( const Entry &e ) { return e.accountId == accountId; } );
+}
+
+void BringUpQueue::schedulePump()
+{
+  // deferred, so the setups nymea runs back to back at boot are ranked against each other
+  if ( m_pumpScheduled )
+    return;
+  m_pumpScheduled = true;
+  QTimer::singleShot( 0, this, &BringUpQueue::pump );
+}
+
+void BringUpQueue::pump()
+{
+  m_pumpScheduled = false;
+
+  while ( !m_queued.isEmpty() && m_running.size() < m_concurrency ) {
+    const Entry entry = m_queued.takeFirst();
+    const quint64 generation = ++m_nextGeneration;
+    m_running.insert( entry.accountId, generation );
+
+    QTimer::singleShot( slotTimeout, this, [this, accountId = entry.accountId, generation]() {
+      if ( m_running.value( accountId ) != generation )
+        return;
+      qCDebug(dcNeato()) << "Account" << accountId.toString() << "did not come up in time, starting the next one";
+      finish( accountId );
+    });
+
+    qCDebug(dcNeato()) << "Bringing up account" << entry.accountId.toString() << m_queued.size() << "waiting";
+    entry.start();
+  }
+}
@@ -0,0 +1,72 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BRINGUPQUEUE_H
+#define BRINGUPQUEUE_H
+
+#include <integrations/thing.h>
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <chrono>
+#include <functional>
+
+/*!
+  Brings accounts up one batch at a time after a restart.
+
+  nymea sets up all account things at once, each one refreshing its token and
+  reloading its robot list. Only a few accounts are started concurrently here, the
+  ones whose robots were active most recently first. An account holds its slot
+  until finish() is called for it or the slot times out.
+*/
+class BringUpQueue : public QObject
+{
+  Q_OBJECT
+public:
+  using Start = std::function<void()>;
+
+  explicit BringUpQueue( int concurrency, QObject *parent = nullptr );
+
+  // accounts with a higher rank start first, all accounts queued in one event loop pass are ranked together
+  void enqueue( const ThingId &accountId, qint64 rank, const Start &start );
+  void finish( const ThingId &accountId );
+  void remove( const ThingId &accountId );
+  // queued or holding a slot
+  bool contains( const ThingId &accountId ) const;
+
+private:
+  struct Entry {
+    ThingId accountId;
+    qint64 rank;
+    Start start;
+  };
+
+  void schedulePump();
+  void pump();
+
+  int m_concurrency;
+  QVector<Entry> m_queued;          // sorted by rank, highest first
+  QHash<ThingId, quint64> m_running; // slot generation, a timed out slot must not free a later one
+  quint64 m_nextGeneration = 0;
+  bool m_pumpScheduled = false;
+};
+
+#endif // BRINGUPQUEUE_H
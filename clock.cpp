@@ -0,0 +1,124 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "clock.h"
+
+#include <QTimer>
+#include <algorithm>
+
+Clock::Clock( QObject *parent )
+  : QObject{parent}
+{
+}
+
+qint64 Clock::now() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+Clock &Clock::steady()
+{
+  static Clock clock;
+  return clock;
+}
+
+void Clock::arm( ClockTimer *timer, qint64 deadline )
+{
+  if ( !timer->m_timer ) {
+    timer->m_timer = new QTimer( timer );
+    timer->m_timer->setSingleShot( true );
+    connect( timer->m_timer, &QTimer::timeout, timer, &ClockTimer::expire );
+  }
+  timer->m_timer->setTimerType( timer->m_timerType );
+  timer->m_timer->start( static_cast<int>( std::max<qint64>( 0, deadline - now() ) ) );
+}
+
+void Clock::disarm( ClockTimer *timer )
+{
+  if ( timer->m_timer )
+    timer->m_timer->stop();
+}
+
+void Clock::expire( ClockTimer *timer )
+{
+  timer->expire();
+}
+
+ClockTimer::ClockTimer( Clock &clock, QObject *parent )
+  : QObject{parent}
+  , m_clock( &clock )
+{
+}
+
+ClockTimer::~ClockTimer()
+{
+  // a clock tracking deadlines must not expire a deleted timer
+  if ( isActive() )
+    m_clock->disarm( this );
+}
+
+void ClockTimer::setSingleShot( bool singleShot )
+{
+  m_singleShot = singleShot;
+}
+
+void ClockTimer::setTimerType( Qt::TimerType type )
+{
+  m_timerType = type;
+}
+
+void ClockTimer::start( std::chrono::milliseconds interval )
+{
+  m_interval = std::max<qint64>( 0, interval.count() );
+  m_deadline = m_clock->now() + m_interval;
+  m_clock->arm( this, m_deadline );
+}
+
+void ClockTimer::stop()
+{
+  if ( !isActive() )
+    return;
+  m_deadline = -1;
+  m_clock->disarm( this );
+}
+
+bool ClockTimer::isActive() const
+{
+  return m_deadline >= 0;
+}
+
+qint64 ClockTimer::remainingTime() const
+{
+  return isActive() ? std::max<qint64>( 0, m_deadline - m_clock->now() ) : -1;
+}
+
+void ClockTimer::expire()
+{
+  if ( !isActive() )
+    return;
+
+  if ( m_singleShot ) {
+    m_deadline = -1;
+  } else {
+    m_deadline += m_interval;
+    m_clock->arm( this, m_deadline );
+  }
+  emit timeout();
+}
@@ -0,0 +1,97 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <QObject>
+#include <chrono>
+
+class QTimer;
+class ClockTimer;
+
+/*!
+  Monotonic time and timers of the cloud client.
+
+  RequestScheduler, Neato and PollScheduler take their time and their timers
+  from a Clock instead of the system, so a test can substitute a virtual clock
+  and run days of token refreshes, polls and robot list reloads in seconds.
+  The base class follows the steady system clock.
+*/
+class Clock : public QObject
+{
+  Q_OBJECT
+public:
+  explicit Clock( QObject *parent = nullptr );
+
+  // milliseconds on a monotonic clock, may be called from any thread
+  virtual qint64 now() const;
+
+  // the steady system clock, for everything running in nymead
+  static Clock &steady();
+
+protected:
+  friend class ClockTimer;
+
+  // timer has to expire at deadline, replaces an earlier deadline of the same timer
+  virtual void arm( ClockTimer *timer, qint64 deadline );
+  virtual void disarm( ClockTimer *timer );
+
+  // for clocks that track deadlines themselves
+  static void expire( ClockTimer *timer );
+};
+
+/*!
+  Stand-in for QTimer running on a Clock.
+*/
+class ClockTimer : public QObject
+{
+  Q_OBJECT
+public:
+  explicit ClockTimer( Clock &clock, QObject *parent = nullptr );
+  ~ClockTimer();
+
+  void setSingleShot( bool singleShot );
+  // only used by the steady clock, coarse like QTimer by default
+  void setTimerType( Qt::TimerType type );
+
+  void start( std::chrono::milliseconds interval );
+  void stop();
+  bool isActive() const;
+  // milliseconds until the timer expires, -1 if it is not active
+  qint64 remainingTime() const;
+
+signals:
+  void timeout();
+
+private:
+  friend class Clock;
+
+  void expire();
+
+  Clock *m_clock;
+  QTimer *m_timer = nullptr; // created by the steady clock on first use
+  Qt::TimerType m_timerType = Qt::CoarseTimer;
+  bool m_singleShot = false;
+  qint64 m_interval = 0;
+  qint64 m_deadline = -1;    // -1 while inactive
+};
+
+#endif // CLOCK_H
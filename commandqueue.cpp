@@ -0,0 +1,106 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "commandqueue.h"
+#include "extern-plugininfo.h"
+
+#include <algorithm>
+
+CommandQueue::CommandQueue( const Dispatcher &dispatcher, QObject *parent )
+  : QObject{parent}
+  , m_dispatcher( dispatcher )
+{
+}
+
+CommandQueue::~CommandQueue()
+{
+  if ( m_inFlight )
+    finish( *m_inFlight, Thing::ThingErrorHardwareNotAvailable, QString() );
+  clear( Thing::ThingErrorHardwareNotAvailable );
+}
+
+void CommandQueue::enqueue( Command command, ThingActionInfo *info )
+{
+  // every pause tap toggles, merging two of them would swallow the resume
+  const bool mergeable = command != Command::Pause;
+
+  // the same command is already on its way, answer all taps with its result
+  if ( mergeable && m_inFlight && m_inFlight->command == command && m_queued.isEmpty() ) {
+    qCDebug(dcNeato()) << "Merging" << command << "into the command in flight";
+    m_inFlight->infos.append( info );
+    return;
+  }
+
+  auto queued = std::find_if( m_queued.begin(), m_queued.end(), [command]( const Pending &p ) { return p.command == command; } );
+  if ( mergeable && queued != m_queued.end() ) {
+    qCDebug(dcNeato()) << "Merging" << command << "into the queued one";
+    queued->infos.append( info );
+    return;
+  }
+
+  // stopping or going home makes waiting cleaning commands pointless, only other stops stay ahead
+  if ( command == Command::Stop || command == Command::ReturnToBase ) {
+    auto superseded = std::stable_partition( m_queued.begin(), m_queued.end(), []( const Pending &p ) {
+      return p.command != Command::Start && p.command != Command::Pause;
+    });
+    for ( auto it = superseded; it != m_queued.end(); ++it ) {
+      qCDebug(dcNeato()) << "Dropping queued" << it->command << "in favor of" << command;
+      finish( *it, Thing::ThingErrorThingInUse, QT_TR_NOOP("The command was superseded by another command.") );
+    }
+    m_queued.erase( superseded, m_queued.end() );
+  }
+
+  m_queued.append( Pending{ command, { info } } );
+  dispatchNext();
+}
+
+void CommandQueue::clear( Thing::ThingError error, const QString &displayMessage )
+{
+  const auto queued = std::move( m_queued );
+  m_queued.clear();
+  for ( const auto &p : queued )
+    finish( p, error, displayMessage );
+}
+
+void CommandQueue::dispatchNext()
+{
+  if ( m_inFlight || m_queued.isEmpty() )
+    return;
+
+  m_inFlight = m_queued.takeFirst();
+  QPointer<CommandQueue> guard( this );
+  m_dispatcher( m_inFlight->command, [this, guard]( Thing::ThingError error, const QString &displayMessage ) {
+    if ( !guard || !m_inFlight )
+      return;
+    const Pending done = std::move( *m_inFlight );
+    m_inFlight.reset();
+    finish( done, error, displayMessage );
+    dispatchNext();
+  });
+}
+
+void CommandQueue::finish( const Pending &pending, Thing::ThingError error, const QString &displayMessage )
+{
+  for ( const auto &info : pending.infos ) {
+    // nymea destroys infos that timed out
+    if ( info )
+      info->finish( error, displayMessage );
+  }
+}
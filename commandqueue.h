@@ -0,0 +1,79 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef COMMANDQUEUE_H
+#define COMMANDQUEUE_H
+
+#include <integrations/thing.h>
+#include <integrations/thingactioninfo.h>
+
+#include <QObject>
+#include <QPointer>
+#include <QVector>
+#include <functional>
+#include <optional>
+
+/*!
+  Serializes the commands sent to one robot.
+
+  Only one command is in flight at a time, the next one is dispatched as soon as
+  it finishes. Queued commands run in the order they were issued, only stop and
+  return to base jump ahead by dropping the queued cleaning commands. Repeated
+  taps of the same command are merged into one request, except for pause which
+  toggles between pausing and resuming.
+*/
+class CommandQueue : public QObject
+{
+  Q_OBJECT
+public:
+  enum class Command {
+    Stop,
+    ReturnToBase,
+    Pause,
+    Start
+  };
+  Q_ENUM(Command)
+
+  using Done = std::function<void( Thing::ThingError error, const QString &displayMessage )>;
+  using Dispatcher = std::function<void( Command command, const Done &done )>;
+
+  explicit CommandQueue( const Dispatcher &dispatcher, QObject *parent = nullptr );
+  ~CommandQueue();
+
+  void enqueue( Command command, ThingActionInfo *info );
+
+  // finishes everything that is still waiting, the in flight command reports on its own
+  void clear( Thing::ThingError error, const QString &displayMessage = QString() );
+
+private:
+  struct Pending {
+    Command command;
+    QVector<QPointer<ThingActionInfo>> infos;
+  };
+
+  void dispatchNext();
+  static void finish( const Pending &pending, Thing::ThingError error, const QString &displayMessage );
+
+  Dispatcher m_dispatcher;
+  std::optional<Pending> m_inFlight;
+  QVector<Pending> m_queued; // in dispatch order, at most one entry per command but pause
+};
+
+#endif // COMMANDQUEUE_H
@@ -21,17 +21,206 @@
 #include "plugininfo.h"
 #include "integrationpluginneato.h"
 #include "neato.h"
+#include "pollscheduler.h"
+#include "robotcache.h"
+#include "commandqueue.h"
+#include "mapcache.h"
+#include "robotregistry.h"
+#include "bringupqueue.h"
 
 #include <network/networkaccessmanager.h>
+#include <integrations/browseresult.h>
+#include <integrations/browseritemresult.h>
 
 #include <QUrlQuery>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 #include <QJsonDocument>
+#include <QTimer>
+#include <QPointer>
+#include <QStandardPaths>
+#include <QFile>
+#include <QLocale>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iterator>
+#include <optional>
+
+namespace {
+    // below this charge level the battery is reported as critical
+    constexpr int batteryCriticalLevel = 10;
+
+    // each logged request summary covers this interval
+    constexpr std::chrono::minutes metricsInterval{15};
+
+    // time the user has to log in after a pairing was started
+    constexpr std::chrono::minutes pairingTimeout{15};
+
+    // index into the robotState possibleValues in integrationpluginneato.json
+    enum class RobotStateValue : quint8 { Docked, Cleaning, Paused, Traveling, Stopped, Error };
+    constexpr std::array<const char *, 6> robotStateValues = { "docked", "cleaning", "paused", "traveling", "stopped", "error" };
+
+    constexpr std::size_t actionCodeCount = static_cast<std::size_t>(Neato::ActionCode::SuspendedExploration) + 1;
+    constexpr std::size_t stateCodeCount = static_cast<std::size_t>(Neato::StateCode::Error) + 1;
+
+    // robotState of a busy robot, indexed by ActionCode
+    constexpr RobotStateValue busyActionValues[] = {
+        RobotStateValue::Cleaning,  // Invalid
+        RobotStateValue::Cleaning,  // HouseCleaning
+        RobotStateValue::Cleaning,  // SpotCleaning
+        RobotStateValue::Cleaning,  // ManualCleaning
+        RobotStateValue::Traveling, // Docking
+        RobotStateValue::Stopped,   // UserMenuActive
+        RobotStateValue::Paused,    // SuspendedCleaning
+        RobotStateValue::Docked,    // Updating
+        RobotStateValue::Docked,    // CopyingLogs
+        RobotStateValue::Traveling, // RecoveringLocation
+        RobotStateValue::Stopped,   // IEC_Test
+        RobotStateValue::Cleaning,  // MapCleaning
+        RobotStateValue::Cleaning,  // ExploringMap
+        RobotStateValue::Cleaning,  // AcquiringPersistentMapIDs
+        RobotStateValue::Cleaning,  // CreatingAndUploadingMap
+        RobotStateValue::Paused     // SuspendedExploration
+    };
+
+    // robotState indexed by StateCode, Idle and Invalid depend on the dock and are resolved at runtime
+    constexpr RobotStateValue stateCodeValues[] = {
+        RobotStateValue::Stopped, // Invalid
+        RobotStateValue::Stopped, // Idle
+        RobotStateValue::Cleaning,// Busy, refined by busyActionValues
+        RobotStateValue::Paused,  // Paused
+        RobotStateValue::Error    // Error
+    };
+
+    static_assert(std::size(busyActionValues) == actionCodeCount, "ActionCode mapping out of sync");
+    static_assert(std::size(stateCodeValues) == stateCodeCount, "StateCode mapping out of sync");
+
+    // browser folders of a robot thing, maps are listed as "<folder>/<map id>"
+    const QString persistentMapsFolder = QStringLiteral("persistent");
+    const QString cleaningMapsFolder = QStringLiteral("cleaning");
+
+    // upper bound for the map images kept on disk
+    constexpr qint64 mapCacheSize = 64 * 1024 * 1024;
+
+    // cached images handed to clients inline, larger ones would bloat the JSON-RPC reply
+    constexpr qint64 maxInlineMapSize = 512 * 1024;
+
+    // clients can not read files on the gateway, a cached image is passed as a data url
+    QString imageDataUrl(const QString &fileName)
+    {
+        QFile file(fileName);
+        if (file.size() > maxInlineMapSize || !file.open(QIODevice::ReadOnly))
+            return QString();
+        return QStringLiteral("data:image/png;base64,") + QString::fromLatin1(file.readAll().toBase64());
+    }
+
+    // accounts refreshing their token and robot list at the same time after a restart
+    constexpr int bringUpConcurrency = 3;
+
+    // worker threads decoding robot lists, robot states and map lists
+    constexpr int replyDecoderThreads = 2;
+
+    // an accepted command is confirmed by a poll this long after it, up to maxReconcilePolls times
+    constexpr std::chrono::milliseconds reconcileDelay = std::chrono::seconds(4);
+    constexpr int maxReconcilePolls = 3;
+
+    /*!
+      What the robot will most likely report once it executed the command
+    */
+    Neato::RobotState predictState(const Neato::RobotState &current, Neato::RobotCommand command)
+    {
+        Neato::RobotState s = current;
+        auto &commands = s.availableCommands;
+        switch (command) {
+        case Neato::RobotCommand::StartCleaning:
+        case Neato::RobotCommand::ResumeCleaning:
+            s.state = Neato::StateCode::Busy;
+            if (command == Neato::RobotCommand::StartCleaning || s.action == Neato::ActionCode::Invalid)
+                s.action = Neato::ActionCode::HouseCleaning;
+            s.details.isCharging = false;
+            s.details.isDocked = false;
+            commands.start = false; commands.resume = false;
+            commands.pause = true; commands.stop = true; commands.goToBase = false;
+            break;
+        case Neato::RobotCommand::PauseCleaning:
+            s.state = Neato::StateCode::Paused;
+            commands.start = false; commands.pause = false;
+            commands.resume = true; commands.stop = true; commands.goToBase = true;
+            break;
+        case Neato::RobotCommand::StopCleaning:
+            s.state = Neato::StateCode::Idle;
+            s.action = Neato::ActionCode::Invalid;
+            commands.pause = false; commands.resume = false; commands.stop = false;
+            commands.start = true; commands.goToBase = true;
+            break;
+        case Neato::RobotCommand::SendToBase:
+            s.state = Neato::StateCode::Busy;
+            s.action = Neato::ActionCode::Docking;
+            commands.start = false; commands.resume = false; commands.goToBase = false;
+            commands.pause = true; commands.stop = true;
+            break;
+        }
+        return s;
+    }
+
+    ThingDescriptor robotDescriptor(const Neato::Robot &robot, const ThingId &accountThingId)
+    {
+        ThingDescriptor thingDescriptor(robotThingClassId, robot.name, robot.model, accountThingId);
+        ParamList params;
+        params.append(Param(robotThingSerialParamTypeId, robot.serial));
+        params.append(Param(robotThingSecretParamTypeId, robot.secret_key));
+        thingDescriptor.setParams(params);
+        return thingDescriptor;
+    }
+
+    RobotStateValue robotStateValue(const Neato::RobotState &state)
+    {
+        switch (state.state) {
+        case Neato::StateCode::Busy:
+            return busyActionValues[static_cast<std::size_t>(state.action)];
+        case Neato::StateCode::Idle:
+        case Neato::StateCode::Invalid:
+            return state.details.isDocked ? RobotStateValue::Docked : RobotStateValue::Stopped;
+        default:
+            return stateCodeValues[static_cast<std::size_t>(state.state)];
+        }
+    }
+}
 
 IntegrationPluginNeato::IntegrationPluginNeato()
+    : m_endpoints(Neato::Endpoints::fromEnvironment())
 {
+    m_startupClock.start();
+    m_bringUp = new BringUpQueue(bringUpConcurrency, this);
+    m_replyDecoder = new ReplyDecoder(replyDecoderThreads, this);
 
+    m_pollScheduler = new PollScheduler(Clock::steady(), this);
+    connect(m_pollScheduler, &PollScheduler::pollDue, this, &IntegrationPluginNeato::pollRobot);
+
+    m_stateFlushTimer = new QTimer(this);
+    m_stateFlushTimer->setSingleShot(true);
+    m_stateFlushTimer->setInterval(std::chrono::seconds(60));
+    connect(m_stateFlushTimer, &QTimer::timeout, this, &IntegrationPluginNeato::flushRobotStates);
+
+    m_metricsTimer = new QTimer(this);
+    m_metricsTimer->setInterval(metricsInterval);
+    connect(m_metricsTimer, &QTimer::timeout, this, &IntegrationPluginNeato::logMetrics);
+    m_metricsTimer->start();
+
+    connect(this, &IntegrationPlugin::configValueChanged, this, [this](const ParamTypeId &paramTypeId) {
+        if (paramTypeId != neatoPluginAccountRequestsPerMinuteParamTypeId && paramTypeId != neatoPluginRobotRequestsPerMinuteParamTypeId)
+            return;
+        const Neato::RateLimits limits = rateLimits();
+        for (Neato *n : qAsConst(m_neatoAccounts))
+            n->setRateLimits(limits);
+    });
+}
+
+IntegrationPluginNeato::~IntegrationPluginNeato()
+{
+    flushRobotStates();
 }
 
 void IntegrationPluginNeato::startPairing(ThingPairingInfo *info)
@@ -51,10 +240,21 @@ void IntegrationPluginNeato::startPairing(ThingPairingInfo *info)
             }
             n = m_neatoAccounts[thingId];
         } else {
-            n = new Neato( *hardwareManager()->networkManager(), apiKey.data("clientId"), apiKey.data("clientSecret"), this );
+            n = new Neato( *requestScheduler(), *m_replyDecoder, m_endpoints, apiKey.data("clientId"), apiKey.data("clientSecret"), this );
 
             // register this account ID
             m_neatoAccounts.insert( info->thingId(), n );
+            m_registry.addAccount( n, info->thingId() );
+
+            // an abandoned pairing never reaches setupThing, drop its instance after a while
+            m_pendingPairings.insert( thingId );
+            QTimer::singleShot( pairingTimeout, this, [this, thingId, n]() {
+                // a retried pairing of the same thing has its own instance and timer
+                if ( m_pendingPairings.contains( thingId ) && m_neatoAccounts.value( thingId ) == n ) {
+                    qCDebug(dcNeato()) << "Pairing of" << thingId << "was not completed, dropping it";
+                    discardAccount( thingId );
+                }
+            });
         }
 
         // Set the OAuth url to the info object
@@ -81,7 +281,7 @@ void IntegrationPluginNeato::confirmPairing(ThingPairingInfo *info, const QStrin
         }
 
         // Extract the code from the callback URL
-        qCDebug(dcNeato()) << "!!!!! Received secret: " << secret;
+        qCDebug(dcNeato()) << "Received OAuth callback for" << thingId;
         QUrl url(secret);
         QUrlQuery query(url);
 
@@ -90,9 +290,16 @@ void IntegrationPluginNeato::confirmPairing(ThingPairingInfo *info, const QStrin
         Neato *n = m_neatoAccounts[thingId];
         connect(n, &Neato::authenticated, info, [this, n, info]( bool success ){
             if ( !success ) {
+                // a new attempt starts over with startPairing and a fresh instance
+                if ( m_pendingPairings.contains( info->thingId() ) )
+                    discardAccount( info->thingId() );
                 info->finish(Thing::ThingErrorSetupFailed, QT_TR_NOOP("Authentication failed. Please try again."));
                 return;
             } else {
+                // store right away, a reconfigured account gets removed and set up again from the storage
+                pluginStorage()->beginGroup(info->thingId().toString());
+                pluginStorage()->setValue("refreshToken", n->refreshToken() );
+                pluginStorage()->endGroup();
                 info->finish(Thing::ThingErrorNoError);
             }
         });
@@ -105,78 +312,94 @@ void IntegrationPluginNeato::confirmPairing(ThingPairingInfo *info, const QStrin
 
 void IntegrationPluginNeato::setupThing(ThingSetupInfo *info)
 {
-    qCDebug(dcNeato()) << "Setup thing" << info->thing()->name() << info->thing()->params();
+    qCDebug(dcNeato()) << "Setup thing" << info->thing()->name();
 
     Thing *thing = info->thing();
     if ( thing->thingClassId() == accountThingClassId ) {
 
-         qCDebug(dcNeato()) << "Setup Account Thing Type";
+        qCDebug(dcNeato()) << "Setup Account Thing Type";
 
-        auto finishSetup = [this, info]( bool authenticated ){
+        const auto &thingId = thing->id();
+        m_pendingPairings.remove(thingId);
+        if ( m_neatoAccounts.contains(thingId) ) {
+            qCDebug(dcNeato()) << "Thing Id was already known, finish thing setup";
+            // freshly paired, we can just use the already existing instance
+            Neato *n = m_neatoAccounts[thingId];
+            connectAccount(n);
+            info->finish(Thing::ThingErrorNoError);
+            accountAuthenticated(thing, true);
+            return;
+        }
 
-            if ( !m_neatoAccounts.contains(info->thing()->id()) ) {
-                info->finish(Thing::ThingErrorAuthenticationFailure);
-                return;
-            }
+        // reloading the account from thing storage
+        pluginStorage()->beginGroup(thingId.toString());
+        QString refreshToken = pluginStorage()->value("refreshToken").toString();
+        QByteArray robotSnapshot = pluginStorage()->value("robots").toByteArray();
+        pluginStorage()->endGroup();
 
-            if ( !authenticated ) {
-                delete m_neatoAccounts.take( info->thing()->id() );
-                info->finish(Thing::ThingErrorAuthenticationFailure);
-                return;
-            }
+        if (refreshToken.isEmpty()) {
+            qCDebug(dcNeato()) << "What no refresh token? I give up";
+            info->finish(Thing::ThingErrorAuthenticationFailure);
+            return;
+        }
 
-            Thing *thing = info->thing();
-            Neato *n = m_neatoAccounts[thing->id()];
+        ApiKey apiKey = apiKeyStorage()->requestKey("neato");
+        Neato *n = new Neato( *requestScheduler(), *m_replyDecoder, m_endpoints, apiKey.data("clientId"), apiKey.data("clientSecret"), this );
 
-            // Store refresh token in the plugin storage
-            pluginStorage()->beginGroup(thing->id().toString());
-            pluginStorage()->setValue("refreshToken", n->refreshToken() );
-            pluginStorage()->endGroup();
+        // register this account ID
+        m_neatoAccounts.insert( thingId, n );
+        m_registry.addAccount( n, thingId );
+        connectAccount(n);
 
-            thing->setStateValue(accountLoggedInStateTypeId, true);
-            thing->setStateValue(accountConnectedStateTypeId, true);
+        // offline first: robots are known from the last run and Nucleo only needs the robot secrets,
+        // so polling can start right away while the token refresh and robot list reload catch up
+        QVector<Neato::Robot> robots;
+        QByteArray etag;
+        if ( RobotCache::deserializeRobots(robotSnapshot, robots, etag) ) {
+            qCDebug(dcNeato()) << "Restored" << robots.size() << "robots from the last run";
+            n->restoreRobots(robots, etag);
+            for (const auto &r : robots) {
+                m_registry.linkRobot(r.serial, n);
+                startPolling(r.serial);
+                if (Thing *robotThing = m_registry.robotThing(r.serial))
+                    applyCleaningSettings(robotThing);
+            }
+        }
 
-            info->finish(Thing::ThingErrorNoError);
+        info->finish(Thing::ThingErrorNoError);
 
-            n->loadRobots();
-            connect(n, &Neato::robotsLoaded, this, &IntegrationPluginNeato::robotsLoaded );
-        };
+        // accounts whose robots cleaned last come up first, the others wait for a free slot
+        m_bringUp->enqueue(thingId, accountRank(thingId), [n, refreshToken]() {
+            n->fetchAcessTokenFromRefreshToken( refreshToken );
+        });
+        return;
+    }
 
-        Neato *n = nullptr;
-        const auto &thingId = thing->id();
-        if ( m_neatoAccounts.contains(thingId) ) {
-             qCDebug(dcNeato()) << "Thing Id was already known, finish thing setup";
-            // freshly paired, we can just use the already existing instance
-            n = m_neatoAccounts[thingId];
-            finishSetup(true);
-        } else {
-            qCDebug(dcNeato()) << "Loading the refresh token and let'se gooo";
-            // reloading the account from thing storage, refresh the token then finish setup
-            ApiKey apiKey = apiKeyStorage()->requestKey("neato");
-            n = new Neato( *hardwareManager()->networkManager(), apiKey.data("clientId"), apiKey.data("clientSecret"), this );
+    if ( thing->thingClassId() == robotThingClassId ) {
+        const QString serial = thing->paramValue(robotThingSerialParamTypeId).toString();
+        m_registry.addRobotThing(serial, thing);
+        startPolling(serial);
 
-            // register this account ID
-            m_neatoAccounts.insert( thingId, n );
+        applyCleaningSettings(thing);
+        connect(thing, &Thing::settingChanged, this, [this, thing](const ParamTypeId &paramTypeId) {
+            if (paramTypeId == robotSettingsEcoParamTypeId || paramTypeId == robotSettingsCareParamTypeId
+                    || paramTypeId == robotSettingsNoGoLinesParamTypeId)
+                applyCleaningSettings(thing);
+        });
 
-            //thing loaded from the thing database, proactively query a refresh token
-            pluginStorage()->beginGroup(thing->id().toString());
-            QString refreshToken = pluginStorage()->value("refreshToken").toString();
+        // show the last known state until the first poll reports back
+        if (!m_robotStates.contains(serial)) {
+            pluginStorage()->beginGroup("robotStates");
+            QByteArray snapshot = pluginStorage()->value(serial).toByteArray();
             pluginStorage()->endGroup();
 
-            if (refreshToken.isEmpty()) {
-                 qCDebug(dcNeato()) << "What no refresh token? I give up";
-                finishSetup(false);
-                return;
-            }
-
-            connect(n, &Neato::authenticated, info, std::move(finishSetup) );
-            n->fetchAcessTokenFromRefreshToken( refreshToken );
+            Neato::RobotState state;
+            if (RobotCache::deserializeState(snapshot, state))
+                m_robotStates.insert(serial, state);
         }
+        if (m_robotStates.contains(serial))
+            pushRobotView(thing, robotView(m_robotStates.value(serial), false));
 
-        return;
-    }
-
-    if ( thing->thingClassId() == robotThingClassId ) {
         return info->finish(Thing::ThingErrorNoError);
     }
 
@@ -186,65 +409,792 @@ void IntegrationPluginNeato::setupThing(ThingSetupInfo *info)
 
 void IntegrationPluginNeato::executeAction(ThingActionInfo *info)
 {
-    qCDebug(dcNeato()) << "Executing action for thing" << info->thing()->name() << info->action().actionTypeId().toString() << info->action().params();
+    qCDebug(dcNeato()) << "Executing action for thing" << info->thing()->name() << info->action().actionTypeId().toString();
+
+    Thing *thing = info->thing();
+    if (thing->thingClassId() == accountThingClassId && info->action().actionTypeId() == accountDumpTraceActionTypeId) {
+        Neato *n = m_neatoAccounts.value(thing->id());
+        if (!n) {
+            info->finish(Thing::ThingErrorHardwareNotAvailable);
+            return;
+        }
+        const QStringList trace = n->dumpTrace();
+        qCInfo(dcNeato()) << "Last" << trace.size() << "requests of account" << thing->name();
+        for (const QString &line : trace)
+            qCInfo(dcNeato()).noquote() << line;
+        info->finish(Thing::ThingErrorNoError);
+        return;
+    }
+
+    if (thing->thingClassId() != robotThingClassId) {
+        info->finish(Thing::ThingErrorActionTypeNotFound);
+        return;
+    }
+
+    CommandQueue::Command command;
+    const ActionTypeId &actionTypeId = info->action().actionTypeId();
+    if (actionTypeId == robotStartCleaningActionTypeId) {
+        command = CommandQueue::Command::Start;
+    } else if (actionTypeId == robotPauseCleaningActionTypeId) {
+        command = CommandQueue::Command::Pause;
+    } else if (actionTypeId == robotReturnToBaseActionTypeId) {
+        command = CommandQueue::Command::ReturnToBase;
+    } else if (actionTypeId == robotStopCleaningActionTypeId) {
+        command = CommandQueue::Command::Stop;
+    } else {
+        info->finish(Thing::ThingErrorActionTypeNotFound);
+        return;
+    }
 
-    info->finish(Thing::ThingErrorNoError);
+    commandQueue(thing->paramValue(robotThingSerialParamTypeId).toString())->enqueue(command, info);
 }
 
 void IntegrationPluginNeato::thingRemoved(Thing *thing)
 {
-    qCDebug(dcNeato()) << "Remove thing" << thing->name() << thing->params();
+    qCDebug(dcNeato()) << "Remove thing" << thing->name();
 
     // Clean up all data related to this thing
+    if (thing->thingClassId() == accountThingClassId) {
+        discardAccount(thing->id());
+    }
+
+    if (thing->thingClassId() == robotThingClassId) {
+        const QString serial = thing->paramValue(robotThingSerialParamTypeId).toString();
+        m_registry.removeRobotThing(serial, thing);
+        m_robotViews.remove(thing->id());
+
+        // another account may still show the same robot
+        if (m_registry.robotThing(serial))
+            return;
+
+        // the robot may be shared with an account other than the thing's, it keeps polling and gets a thing there
+        Neato *parentAccount = m_neatoAccounts.value(thing->parentId());
+        for (Neato *n : m_registry.accounts(serial)) {
+            if (n == parentAccount)
+                continue;
+            const auto &robots = n->robots();
+            const auto robot = std::find_if(robots.cbegin(), robots.cend(), [&serial](const Neato::Robot &r) { return r.serial == serial; });
+            if (robot == robots.cend())
+                continue;
+
+            qCDebug(dcNeato()) << "Robot" << serial << "is still linked to account" << m_registry.accountId(n).toString() << "moving it there";
+            if (parentAccount)
+                parentAccount->cancelRobotRequests(serial);
+            emit autoThingsAppeared({robotDescriptor(*robot, m_registry.accountId(n))});
+            return;
+        }
+
+        startupRobotSettled(serial);
+        for (Neato *n : m_registry.accounts(serial))
+            n->cancelRobotRequests(serial);
+        m_pollScheduler->remove(serial);
+        m_robotStates.remove(serial);
+        m_dirtyRobotStates.remove(serial);
+        m_optimisticStates.remove(serial);
+        m_mapListings.remove(serial + '/' + QString::number(static_cast<int>(Neato::MapKind::Persistent)));
+        m_mapListings.remove(serial + '/' + QString::number(static_cast<int>(Neato::MapKind::Cleaning)));
+        delete m_commandQueues.take(serial);
+
+        pluginStorage()->beginGroup("robotStates");
+        pluginStorage()->remove(serial);
+        pluginStorage()->endGroup();
+    }
 }
 
-void IntegrationPluginNeato::robotsLoaded()
+void IntegrationPluginNeato::browseThing(BrowseResult *result)
+{
+    const QString serial = result->thing()->paramValue(robotThingSerialParamTypeId).toString();
+
+    if (result->itemId().isEmpty()) {
+        // without an account the capabilities are unknown, offer both folders then
+        Neato *n = m_registry.account(serial);
+        const Neato::Capabilities caps = n ? n->capabilities(serial) : Neato::Capabilities(Neato::Capability::PersistentMaps);
+
+        if (Neato::supportsMaps(caps, Neato::MapKind::Persistent)) {
+            BrowserItem persistent(persistentMapsFolder, QT_TR_NOOP("Floor plans"), true, false);
+            persistent.setIcon(BrowserItem::BrowserIconFolder);
+            result->addItem(persistent);
+        }
+
+        if (Neato::supportsMaps(caps, Neato::MapKind::Cleaning)) {
+            BrowserItem cleaning(cleaningMapsFolder, QT_TR_NOOP("Cleaning maps"), true, false);
+            cleaning.setIcon(BrowserItem::BrowserIconFolder);
+            result->addItem(cleaning);
+        }
+
+        result->finish(Thing::ThingErrorNoError);
+        return;
+    }
+
+    Neato::MapKind kind;
+    if (result->itemId() == persistentMapsFolder) {
+        kind = Neato::MapKind::Persistent;
+    } else if (result->itemId() == cleaningMapsFolder) {
+        kind = Neato::MapKind::Cleaning;
+    } else {
+        result->finish(Thing::ThingErrorItemNotFound);
+        return;
+    }
+
+    withMapListing(serial, kind, result, [this, result](const MapListing *listing) {
+        if (!listing) {
+            result->finish(Thing::ThingErrorHardwareNotAvailable, QT_TR_NOOP("Could not load the maps of this robot."));
+            return;
+        }
+
+        for (const auto &map : listing->maps)
+            result->addItem(mapBrowserItem(result->itemId() + '/' + map.id, map));
+        result->finish(Thing::ThingErrorNoError);
+    });
+}
+
+void IntegrationPluginNeato::browserItem(BrowserItemResult *result)
+{
+    const QString serial = result->thing()->paramValue(robotThingSerialParamTypeId).toString();
+    const QString itemId = result->itemId();
+    const QString folder = itemId.section('/', 0, 0);
+    const QString mapId = itemId.section('/', 1);
+
+    Neato::MapKind kind;
+    if (folder == persistentMapsFolder) {
+        kind = Neato::MapKind::Persistent;
+    } else if (folder == cleaningMapsFolder) {
+        kind = Neato::MapKind::Cleaning;
+    } else {
+        result->finish(Thing::ThingErrorItemNotFound);
+        return;
+    }
+
+    if (mapId.isEmpty()) {
+        BrowserItem item(folder, kind == Neato::MapKind::Persistent ? QT_TR_NOOP("Floor plans") : QT_TR_NOOP("Cleaning maps"), true, false);
+        item.setIcon(BrowserItem::BrowserIconFolder);
+        result->finish(item);
+        return;
+    }
+
+    withMapListing(serial, kind, result, [this, result, itemId, mapId](const MapListing *listing) {
+        if (!listing) {
+            result->finish(Thing::ThingErrorHardwareNotAvailable, QT_TR_NOOP("Could not load the maps of this robot."));
+            return;
+        }
+
+        const auto map = std::find_if(listing->maps.cbegin(), listing->maps.cend(), [&mapId](const Neato::MapInfo &m) { return m.id == mapId; });
+        if (map == listing->maps.cend()) {
+            result->finish(Thing::ThingErrorItemNotFound);
+            return;
+        }
+
+        result->finish(mapBrowserItem(itemId, *map));
+
+        // keep a copy of the opened map for when its url expired and the cloud can not sign a new one
+        if (m_mapCache->cachedFile(mapId).isEmpty() && map->validUntil > QDateTime::currentDateTimeUtc())
+            m_mapCache->fetch(map->id, map->url);
+    });
+}
+
+void IntegrationPluginNeato::withMapListing(const QString &robotSerial, Neato::MapKind kind, QObject *context, const std::function<void(const MapListing *)> &callback)
+{
+    if (!m_mapCache) {
+        const QString directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/neato/maps");
+        m_mapCache = new MapCache(*requestScheduler(), directory, mapCacheSize, this);
+    }
+
+    const QString key = robotSerial + '/' + QString::number(static_cast<int>(kind));
+    const auto cached = m_mapListings.constFind(key);
+    if (cached != m_mapListings.constEnd() && cached->validUntil > QDateTime::currentDateTimeUtc()) {
+        callback(&*cached);
+        return;
+    }
+
+    Neato *n = m_registry.account(robotSerial);
+    if (!n) {
+        callback(cached != m_mapListings.constEnd() ? &*cached : nullptr);
+        return;
+    }
+
+    QPointer<QObject> guard(context);
+    n->loadMaps(robotSerial, kind, [this, key, guard, callback](bool ok, const QVector<Neato::MapInfo> &maps) {
+        if (!ok) {
+            // fall back to the last listing, its images are served from the cache then
+            const auto stale = m_mapListings.constFind(key);
+            if (guard)
+                callback(stale != m_mapListings.constEnd() ? &*stale : nullptr);
+            return;
+        }
+
+        // the listing is reused as long as all image urls in it are still valid
+        MapListing listing;
+        listing.maps = maps;
+        listing.validUntil = QDateTime::currentDateTimeUtc().addSecs(300);
+        for (const auto &map : maps)
+            listing.validUntil = std::min(listing.validUntil, map.validUntil);
+        auto stored = m_mapListings.insert(key, listing);
+
+        if (guard)
+            callback(&*stored);
+    });
+}
+
+BrowserItem IntegrationPluginNeato::mapBrowserItem(const QString &itemId, const Neato::MapInfo &map)
+{
+    const QString displayName = !map.name.isEmpty() ? map.name
+                                                    : QLocale().toString(map.startAt.toLocalTime(), QLocale::ShortFormat);
+    BrowserItem item(itemId, displayName, false, false);
+    item.setIcon(BrowserItem::BrowserIconPictures);
+
+    // the signed url as long as it is valid, the cached image once it expired
+    if (map.validUntil > QDateTime::currentDateTimeUtc()) {
+        item.setThumbnail(map.url.toString());
+    } else {
+        const QString file = m_mapCache->cachedFile(map.id);
+        if (!file.isEmpty())
+            item.setThumbnail(imageDataUrl(file));
+    }
+    return item;
+}
+
+void IntegrationPluginNeato::robotsLoaded(const Neato::RobotListDiff &diff)
 {
     Neato *n = qobject_cast<Neato *>(sender());
     if ( !n )
         return;
 
-    ThingId accountThingId = m_neatoAccounts.key(n);
+    ThingId accountThingId = m_registry.accountId(n);
 
     Thing* accountThing = myThings().findById(accountThingId);
     if (!accountThing)
         return;
 
     const auto &robots = n->robots();
-    {
-        QList<ThingDescriptor> newRobots;
-
-        // lets make sure all robots are registered
-        for ( const auto &r : robots ) {
-            Thing *robotThing = myThings().findByParams(ParamList() << Param(robotThingSerialParamTypeId, r.serial));
-            if (robotThing) {
-                if (robotThing->name() != r.name) {
-                    qDebug(dcNeato()) << "Updating group name" << robotThing->name() << "to" << r.name;
-                    robotThing->setName( r.name );
+
+    pluginStorage()->beginGroup(accountThingId.toString());
+    pluginStorage()->setValue("robots", RobotCache::serializeRobots(robots, n->robotsETag()));
+    pluginStorage()->endGroup();
+
+    QList<ThingDescriptor> newRobots;
+    for ( const auto &r : diff.added ) {
+        m_registry.linkRobot(r.serial, n);
+        startPolling(r.serial);
+
+        if (Thing *robotThing = m_registry.robotThing(r.serial)) {
+            // thing is known already, e.g. there was no robot list snapshot
+            if (robotThing->name() != r.name)
+                robotThing->setName(r.name);
+            robotThing->setParamValue(robotThingSecretParamTypeId, r.secret_key);
+            applyCleaningSettings(robotThing);
+            continue;
+        }
+
+        //new thing, add to the system
+        newRobots.append(robotDescriptor(r, accountThingId));
+    }
+    if (!newRobots.isEmpty())
+        emit autoThingsAppeared(newRobots);
+
+    for ( const auto &r : diff.renamed ) {
+        for (Thing *robotThing : m_registry.robotThings(r.serial)) {
+            qDebug(dcNeato()) << "Updating robot name" << robotThing->name() << "to" << r.name;
+            robotThing->setName( r.name );
+        }
+    }
+
+    for ( const auto &r : diff.secretRotated ) {
+        for (Thing *robotThing : m_registry.robotThings(r.serial))
+            robotThing->setParamValue(robotThingSecretParamTypeId, r.secret_key );
+    }
+
+    // remove vanished devices
+    for ( const auto &serial : diff.vanished ) {
+        m_registry.unlinkRobot(serial, n);
+        if (!m_registry.account(serial)) {
+            m_pollScheduler->remove(serial);
+            startupRobotSettled(serial);
+        }
+        for (Thing *robotThing : m_registry.robotThings(serial)) {
+            if (robotThing->parentId() == accountThingId)
+                emit autoThingDisappeared(robotThing->id());
+        }
+    }
+
+    if (diff.initial) {
+        // nothing to compare with, check the existing robot things of the account once
+        QSet<QString> serials;
+        serials.reserve(robots.size());
+        for ( const auto &r : robots )
+            serials.insert(r.serial);
+
+        for ( Thing *robotThing : myThings().filterByParentId(accountThingId) ) {
+            const QString robotSerial = robotThing->paramValue(robotThingSerialParamTypeId).toString();
+            if (!serials.contains(robotSerial)) {
+                if (!m_registry.account(robotSerial))
+                    m_pollScheduler->remove(robotSerial);
+                emit autoThingDisappeared(robotThing->id());
+            }
+        }
+    }
+}
+
+void IntegrationPluginNeato::startPolling(const QString &robotSerial)
+{
+    // robots are polled once they have a thing and an account to reach them through
+    if (!m_registry.robotThing(robotSerial) || !m_registry.account(robotSerial) || m_pollScheduler->contains(robotSerial))
+        return;
+
+    m_pollScheduler->add(robotSerial);
+    if (!m_startupReported)
+        m_startupRobots.insert(robotSerial);
+}
+
+void IntegrationPluginNeato::pollRobot(const QString &robotSerial)
+{
+    Neato *n = m_registry.account(robotSerial);
+    if (!n || !m_registry.robotThing(robotSerial)) {
+        qCDebug(dcNeato()) << "Robot" << robotSerial << "has no account or thing anymore, stop polling it";
+        m_pollScheduler->remove(robotSerial);
+        return;
+    }
+    n->pollRobotState(robotSerial);
+}
+
+void IntegrationPluginNeato::robotStateReceived(const QString &robotSerial, const Neato::RobotState &state)
+{
+    // a reply for a robot whose thing was removed meanwhile must not bring its stored state back
+    if (!m_registry.robotThing(robotSerial))
+        return;
+
+    Neato::RobotState effective = state;
+    bool reconciling = false;
+
+    auto optimistic = m_optimisticStates.find(robotSerial);
+    if (optimistic != m_optimisticStates.end()) {
+        if (robotStateValue(optimistic->predicted) == robotStateValue(state)) {
+            m_optimisticStates.erase(optimistic);
+        } else if (++optimistic->polls < maxReconcilePolls) {
+            // the robot might not have picked up the command yet, keep the prediction a little longer
+            effective.state = optimistic->predicted.state;
+            effective.action = optimistic->predicted.action;
+            effective.availableCommands = optimistic->predicted.availableCommands;
+            reconciling = true;
+        } else {
+            qCDebug(dcNeato()) << "Robot" << robotSerial << "disagrees with the optimistic state, rolling back";
+            m_optimisticStates.erase(optimistic);
+        }
+    }
+
+    m_robotStates.insert(robotSerial, effective);
+    if (reconciling)
+        m_pollScheduler->scheduleIn(robotSerial, reconcileDelay);
+    else
+        m_pollScheduler->schedule(robotSerial, effective);
+
+    startupRobotSettled(robotSerial);
+
+    // persisting is batched, a busy robot reports every few seconds
+    m_dirtyRobotStates.insert(robotSerial);
+    if (!m_stateFlushTimer->isActive())
+        m_stateFlushTimer->start();
+
+    const RobotView view = robotView(effective, true);
+    for (Thing *robotThing : m_registry.robotThings(robotSerial))
+        pushRobotView(robotThing, view);
+}
+
+void IntegrationPluginNeato::applyCleaningSettings(Thing *robotThing)
+{
+    const QString serial = robotThing->paramValue(robotThingSerialParamTypeId).toString();
+
+    Neato::CleaningSettings settings;
+    settings.eco = robotThing->setting(robotSettingsEcoParamTypeId).toBool();
+    settings.care = robotThing->setting(robotSettingsCareParamTypeId).toBool();
+    settings.noGoLines = robotThing->setting(robotSettingsNoGoLinesParamTypeId).toBool();
+
+    // every account of a shared robot has the body ready in case it takes over
+    for (Neato *n : m_registry.accounts(serial))
+        n->setCleaningSettings(serial, settings);
+}
+
+IntegrationPluginNeato::RobotView IntegrationPluginNeato::robotView(const Neato::RobotState &state, bool connected)
+{
+    RobotView view;
+    view.robotState = static_cast<quint8>(robotStateValue(state));
+    view.charging = state.details.isCharging;
+    view.batteryLevel = state.details.charge;
+    view.batteryCritical = state.details.charge < batteryCriticalLevel;
+    // nucleo reports "ui_alert_invalid" if there is nothing to report
+    view.errorMessage = state.error.isEmpty() || state.error == QLatin1String("ui_alert_invalid") ? QStringLiteral("no error") : state.error;
+    view.connected = connected;
+    return view;
+}
+
+void IntegrationPluginNeato::pushRobotView(Thing *robotThing, const RobotView &view)
+{
+    // every state change fans out to rules and clients, so only forward what actually changed
+    const auto previous = m_robotViews.constFind(robotThing->id());
+    const bool initial = previous == m_robotViews.constEnd();
+
+    if (initial || previous->connected != view.connected)
+        robotThing->setStateValue(robotConnectedStateTypeId, view.connected);
+    if (initial || previous->robotState != view.robotState)
+        robotThing->setStateValue(robotRobotStateStateTypeId, QString::fromLatin1(robotStateValues[view.robotState]));
+    if (initial || previous->charging != view.charging)
+        robotThing->setStateValue(robotChargingStateTypeId, view.charging);
+    if (initial || previous->batteryLevel != view.batteryLevel)
+        robotThing->setStateValue(robotBatteryLevelStateTypeId, view.batteryLevel);
+    if (initial || previous->batteryCritical != view.batteryCritical)
+        robotThing->setStateValue(robotBatteryCriticalStateTypeId, view.batteryCritical);
+    if (initial || previous->errorMessage != view.errorMessage)
+        robotThing->setStateValue(robotErrorMessageStateTypeId, view.errorMessage);
+
+    m_robotViews.insert(robotThing->id(), view);
+}
+
+void IntegrationPluginNeato::robotStateFailed(const QString &robotSerial, int httpStatus)
+{
+    Q_UNUSED(httpStatus)
+
+    auto optimistic = m_optimisticStates.find(robotSerial);
+    if (optimistic != m_optimisticStates.end() && ++optimistic->polls >= maxReconcilePolls) {
+        // never got a confirmation, fall back to what the robot reported before the command
+        qCDebug(dcNeato()) << "Could not confirm the optimistic state of" << robotSerial << ", rolling back";
+        m_robotStates.insert(robotSerial, optimistic->previous);
+        m_optimisticStates.erase(optimistic);
+        optimistic = m_optimisticStates.end();
+    }
+
+    if (optimistic != m_optimisticStates.end())
+        m_pollScheduler->scheduleIn(robotSerial, reconcileDelay);
+    else
+        m_pollScheduler->scheduleRetry(robotSerial);
+
+    const auto known = m_robotStates.constFind(robotSerial);
+    if (known == m_robotStates.constEnd()) {
+        // nothing reported yet, a default state would claim an empty battery
+        for (Thing *robotThing : m_registry.robotThings(robotSerial)) {
+            robotThing->setStateValue(robotConnectedStateTypeId, false);
+            auto view = m_robotViews.find(robotThing->id());
+            if (view != m_robotViews.end())
+                view->connected = false;
+        }
+        return;
+    }
+
+    const RobotView view = robotView(*known, false);
+    for (Thing *robotThing : m_registry.robotThings(robotSerial))
+        pushRobotView(robotThing, view);
+}
+
+void IntegrationPluginNeato::applyOptimisticState(const QString &robotSerial, Neato::RobotCommand command)
+{
+    const Neato::RobotState previous = m_robotStates.value(robotSerial);
+    const Neato::RobotState predicted = predictState(previous, command);
+
+    // keep the state from before the first of several stacked commands for a rollback
+    auto known = m_optimisticStates.constFind(robotSerial);
+    OptimisticState optimistic{ predicted, known != m_optimisticStates.constEnd() ? known->previous : previous, 0 };
+    m_optimisticStates.insert(robotSerial, optimistic);
+    m_robotStates.insert(robotSerial, predicted);
+
+    const RobotView view = robotView(predicted, true);
+    for (Thing *robotThing : m_registry.robotThings(robotSerial))
+        pushRobotView(robotThing, view);
+
+    // one targeted poll to confirm, the regular interval resumes afterwards
+    m_pollScheduler->scheduleIn(robotSerial, reconcileDelay);
+}
+
+void IntegrationPluginNeato::discardAccount(const ThingId &thingId)
+{
+    m_pendingPairings.remove(thingId);
+    m_bringUp->remove(thingId);
+    Neato *n = m_neatoAccounts.take(thingId);
+    if (n) {
+        m_sessionAccounts.remove(n);
+        // in-flight requests are aborted right away, the instance itself may still be on the stack
+        n->cancel();
+        m_registry.removeAccount(n);
+        n->deleteLater();
+    }
+}
+
+RequestScheduler *IntegrationPluginNeato::requestScheduler()
+{
+    // created on first use, the hardware manager is not available in the constructor yet
+    if (!m_requestScheduler) {
+        m_requestScheduler = new RequestScheduler(*hardwareManager()->networkManager(), Clock::steady(), this);
+        m_endpoints.applyHostLimits(*m_requestScheduler);
+        connect(m_requestScheduler, &RequestScheduler::hostAvailabilityChanged, this, &IntegrationPluginNeato::hostAvailabilityChanged);
+        connect(m_requestScheduler, &RequestScheduler::hostProbeDue, this, [this](const QString &host) {
+            if (host == RequestScheduler::hostKey(m_endpoints.nucleo)) {
+                // the next poll probes whether Nucleo is back
+                m_pollScheduler->setPaused(false);
+            } else if (host == RequestScheduler::hostKey(m_endpoints.beehive)) {
+                // polls never reach Beehive, the robot list of one logged in account probes it
+                for (Neato *n : qAsConst(m_neatoAccounts)) {
+                    if (!n->accessToken().isEmpty()) {
+                        qCDebug(dcNeato()) << "Probing Beehive with the robot list of account" << m_registry.accountId(n).toString();
+                        n->loadRobots();
+                        return;
+                    }
                 }
-                // make sure secret is up2date
-                robotThing->setParamValue(robotThingSecretParamTypeId, r.secret_key );
-            } else {
-                //new thing, add to the system
-                ThingDescriptor thingDescriptor(robotThingClassId, r.name, r.model, accountThingId );
-                ParamList params;
-                params.append(Param(robotThingSerialParamTypeId, r.serial));
-                params.append(Param(robotThingSecretParamTypeId, r.secret_key));
-                thingDescriptor.setParams(params);
-                newRobots.append(thingDescriptor);
             }
+        });
+    }
+    return m_requestScheduler;
+}
+
+Neato::RateLimits IntegrationPluginNeato::rateLimits() const
+{
+    Neato::RateLimits limits;
+    limits.accountPerMinute = configValue(neatoPluginAccountRequestsPerMinuteParamTypeId).toInt();
+    limits.robotPerMinute = configValue(neatoPluginRobotRequestsPerMinuteParamTypeId).toInt();
+    return limits;
+}
+
+bool IntegrationPluginNeato::isCloudHost(const QString &host) const
+{
+    return host == RequestScheduler::hostKey(m_endpoints.beehive) || host == RequestScheduler::hostKey(m_endpoints.nucleo);
+}
+
+void IntegrationPluginNeato::hostAvailabilityChanged(const QString &host, bool available)
+{
+    // hosts serving map images do not affect polling
+    if (!isCloudHost(host))
+        return;
+
+    if (!available) {
+        // polls would only pile up in the scheduler, hold them for every account until the host recovers
+        if (!m_pollScheduler->isPaused())
+            qCWarning(dcNeato()) << "Neato cloud host" << host << "is unavailable, pausing robot polling";
+        m_pollScheduler->setPaused(true);
+        return;
+    }
+
+    if (!m_requestScheduler->isAvailable(RequestScheduler::hostKey(m_endpoints.beehive))
+            || !m_requestScheduler->isAvailable(RequestScheduler::hostKey(m_endpoints.nucleo)))
+        return;
+
+    qCDebug(dcNeato()) << "Neato cloud is reachable again, resuming robot polling";
+    m_pollScheduler->setPaused(false);
+    if (host == RequestScheduler::hostKey(m_endpoints.beehive)) {
+        // refreshes the connected state of the accounts, costs a 304 per account,
+        // in batches like at startup so a recovering Beehive is not hit by all accounts at once
+        for (auto it = m_neatoAccounts.cbegin(); it != m_neatoAccounts.cend(); ++it) {
+            Neato *n = it.value();
+            // an account still coming up or without a token yet loads its robots once it is logged in,
+            // replacing its queued token refresh would leave it logged out for good
+            if (m_bringUp->contains(it.key()) || n->accessToken().isEmpty())
+                continue;
+            m_bringUp->enqueue(it.key(), accountRank(it.key()), [n]() {
+                n->loadRobots();
+            });
+        }
+    }
+}
+
+void IntegrationPluginNeato::connectAccount(Neato *n)
+{
+    // drop connections of an earlier setup of the same account
+    n->disconnect(this);
+    m_sessionAccounts.remove(n);
+    connect(n, &Neato::authenticated, this, [this, n](bool authenticated) {
+        Thing *thing = myThings().findById(m_registry.accountId(n));
+        if (thing)
+            accountAuthenticated(thing, authenticated);
+        accountAvailable(n, authenticated);
+        // a working token is followed by the robot list, the slot is kept until that is answered
+        if (!authenticated)
+            m_bringUp->finish(m_registry.accountId(n));
+    });
+    // any answer to the robot list frees the slot, also 403 or 404 and requests dropped without a token
+    connect(n, &Neato::robotsLoadFinished, this, [this, n]() {
+        m_bringUp->finish(m_registry.accountId(n));
+    });
+    connect(n, &Neato::authenticationStatusChanged, this, [this, n]() {
+        m_bringUp->finish(m_registry.accountId(n));
+    });
+    connect(n, &Neato::connectionChanged, this, [this, n](bool connected) {
+        Thing *thing = myThings().findById(m_registry.accountId(n));
+        if (thing)
+            thing->setStateValue(accountConnectedStateTypeId, connected);
+        accountAvailable(n, connected);
+        // the list may be parked behind a token retry, the retry must not hold the slot
+        if (!connected) {
+            m_sessionAccounts.remove(n);
+            m_bringUp->finish(m_registry.accountId(n));
         }
+    });
+    connect(n, &Neato::robotsLoaded, this, &IntegrationPluginNeato::robotsLoaded);
+    connect(n, &Neato::robotStateReceived, this, &IntegrationPluginNeato::robotStateReceived);
+    connect(n, &Neato::robotStateFailed, this, &IntegrationPluginNeato::robotStateFailed);
+    connect(n, &Neato::robotStatePollShed, this, [this](const QString &robotSerial, qint64 retryInMs) {
+        if (m_pollScheduler->contains(robotSerial))
+            m_pollScheduler->scheduleIn(robotSerial, std::chrono::milliseconds(retryInMs));
+    });
+    n->setRateLimits(rateLimits());
+}
 
-        if (!newRobots.isEmpty())
-            emit autoThingsAppeared(newRobots);
+void IntegrationPluginNeato::accountAvailable(Neato *n, bool available)
+{
+    // shared robots fail over to the next account with a working session
+    const QStringList moved = m_registry.setAccountAvailable(n, available);
+    for (const QString &robotSerial : moved) {
+        Neato *owner = m_registry.account(robotSerial);
+        qCInfo(dcNeato()) << "Robot" << robotSerial << "is now polled through account" << m_registry.accountId(owner).toString();
+        if (m_pollScheduler->contains(robotSerial))
+            m_pollScheduler->scheduleIn(robotSerial, std::chrono::milliseconds(0));
     }
+}
 
-    // remove vanished devices
-    for ( Thing *robotThing : myThings().filterByParentId(accountThingId) ) {
-        QString robotSerial = robotThing->paramValue(robotThingSerialParamTypeId).toString();
-        bool deviceFound = std::any_of( robots.begin(), robots.end(), [&robotSerial]( const auto &r ) { return r.serial == robotSerial; } );
-        if (!deviceFound) {
-            emit autoThingDisappeared(robotThing->id());
+void IntegrationPluginNeato::accountAuthenticated(Thing *thing, bool authenticated)
+{
+    Neato *n = m_neatoAccounts.value(thing->id());
+    if (!n)
+        return;
+
+    if (!authenticated) {
+        m_sessionAccounts.remove(n);
+        qCWarning(dcNeato()) << "Account" << thing->name() << "is not logged in anymore";
+        thing->setStateValue(accountLoggedInStateTypeId, false);
+        thing->setStateValue(accountConnectedStateTypeId, false);
+        return;
+    }
+
+    // Store refresh token in the plugin storage
+    pluginStorage()->beginGroup(thing->id().toString());
+    pluginStorage()->setValue("refreshToken", n->refreshToken() );
+    pluginStorage()->endGroup();
+
+    thing->setStateValue(accountLoggedInStateTypeId, true);
+    thing->setStateValue(accountConnectedStateTypeId, true);
+
+    // reconcile the restored robot list after the first login and after an outage, not on every token refresh
+    if (!m_sessionAccounts.contains(n)) {
+        m_sessionAccounts.insert(n);
+        n->loadRobots();
+    }
+}
+
+void IntegrationPluginNeato::flushRobotStates()
+{
+    QSet<Neato *> activeAccounts;
+    pluginStorage()->beginGroup("robotStates");
+    for (const QString &serial : qAsConst(m_dirtyRobotStates)) {
+        const auto state = m_robotStates.constFind(serial);
+        if (state == m_robotStates.constEnd())
+            continue;
+        pluginStorage()->setValue(serial, RobotCache::serializeState(*state));
+        if (state->state == Neato::StateCode::Busy) {
+            for (Neato *n : m_registry.accounts(serial))
+                activeAccounts.insert(n);
         }
     }
+    pluginStorage()->endGroup();
+    m_dirtyRobotStates.clear();
+
+    // ranks the accounts on the next start
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (Neato *n : qAsConst(activeAccounts)) {
+        pluginStorage()->beginGroup(m_registry.accountId(n).toString());
+        pluginStorage()->setValue("lastActive", now);
+        pluginStorage()->endGroup();
+    }
+}
+
+qint64 IntegrationPluginNeato::accountRank(const ThingId &accountId)
+{
+    // accounts whose robots were busy last come first
+    pluginStorage()->beginGroup(accountId.toString());
+    const qint64 lastActive = pluginStorage()->value("lastActive").toLongLong();
+    pluginStorage()->endGroup();
+    return lastActive;
+}
+
+void IntegrationPluginNeato::startupRobotSettled(const QString &robotSerial)
+{
+    if (!m_startupRobots.remove(robotSerial) || !m_startupRobots.isEmpty())
+        return;
+
+    m_startupReported = true;
+    qCInfo(dcNeato()) << "All robots reported their state" << m_startupClock.elapsed() << "ms after startup";
+}
+
+void IntegrationPluginNeato::logMetrics()
+{
+    for (auto it = m_neatoAccounts.cbegin(); it != m_neatoAccounts.cend(); ++it) {
+        qCInfo(dcNeato()) << "Requests of account" << it.key().toString() << it.value()->metrics().summary();
+        it.value()->metrics().reset();
+    }
+    qCInfo(dcNeato()) << "Live replies:" << (m_requestScheduler ? m_requestScheduler->liveReplies() : 0)
+                      << "accounts:" << Neato::instanceCount();
+    if (!m_startupRobots.isEmpty())
+        qCInfo(dcNeato()) << m_startupRobots.size() << "robots did not report a state since startup," << m_startupClock.elapsed() << "ms ago";
+}
+
+CommandQueue *IntegrationPluginNeato::commandQueue(const QString &robotSerial)
+{
+    CommandQueue *queue = m_commandQueues.value(robotSerial);
+    if (!queue) {
+        queue = new CommandQueue([this, robotSerial](CommandQueue::Command command, const CommandQueue::Done &done) {
+            dispatchCommand(robotSerial, command, done);
+        }, this);
+        m_commandQueues.insert(robotSerial, queue);
+    }
+    return queue;
+}
+
+void IntegrationPluginNeato::dispatchCommand(const QString &robotSerial, CommandQueue::Command command, const CommandQueue::Done &done)
+{
+    Neato *n = m_registry.account(robotSerial);
+    if (!n) {
+        done(Thing::ThingErrorHardwareNotAvailable, QT_TR_NOOP("The robot is not known to any account."));
+        return;
+    }
+
+    // check against what the robot reported last, no need for a round trip it would reject anyway
+    const auto state = m_robotStates.constFind(robotSerial);
+    const bool known = state != m_robotStates.constEnd();
+
+    std::optional<Neato::RobotCommand> robotCommand;
+    switch (command) {
+    case CommandQueue::Command::Start:
+        if (!known || state->availableCommands.start)
+            robotCommand = Neato::RobotCommand::StartCleaning;
+        break;
+    case CommandQueue::Command::Pause:
+        // the action toggles between pause and resume
+        if (known && state->state == Neato::StateCode::Paused) {
+            if (state->availableCommands.resume)
+                robotCommand = Neato::RobotCommand::ResumeCleaning;
+        } else if (!known || state->availableCommands.pause) {
+            robotCommand = Neato::RobotCommand::PauseCleaning;
+        }
+        break;
+    case CommandQueue::Command::ReturnToBase:
+        if (!known || state->availableCommands.goToBase)
+            robotCommand = Neato::RobotCommand::SendToBase;
+        break;
+    case CommandQueue::Command::Stop:
+        if (!known || state->availableCommands.stop)
+            robotCommand = Neato::RobotCommand::StopCleaning;
+        break;
+    }
+
+    if (!robotCommand) {
+        qCDebug(dcNeato()) << "Robot" << robotSerial << "does not accept" << command << "right now";
+        done(Thing::ThingErrorThingInUse, QT_TR_NOOP("The robot does not accept this command in its current state."));
+        return;
+    }
+
+    const Neato::RobotCommand sent = *robotCommand;
+    n->sendRobotCommand(robotSerial, sent, [this, robotSerial, sent, done](bool accepted, int httpStatus) {
+        if (accepted) {
+            applyOptimisticState(robotSerial, sent);
+            done(Thing::ThingErrorNoError, QString());
+        } else if (httpStatus == 0 || httpStatus == 404) {
+            // nucleo answers 404 if the robot is not online
+            done(Thing::ThingErrorHardwareNotAvailable, QT_TR_NOOP("The robot is not connected."));
+        } else {
+            done(Thing::ThingErrorHardwareFailure, QT_TR_NOOP("The robot rejected the command."));
+        }
+    });
 }
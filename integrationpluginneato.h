@@ -22,9 +22,22 @@
 #define IntegrationPluginNeato_H_INCLUDED
 
 #include <integrations/integrationplugin.h>
+#include <types/browseritem.h>
 #include <QHash>
+#include <QSet>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <functional>
 
-class Neato;
+#include "neato.h"
+#include "commandqueue.h"
+#include "robotregistry.h"
+
+class PollScheduler;
+class BringUpQueue;
+class ReplyDecoder;
+class MapCache;
+class QTimer;
 class IntegrationPluginNeato : public IntegrationPlugin
 {
     Q_OBJECT
@@ -35,6 +48,7 @@ class IntegrationPluginNeato : public IntegrationPlugin
 
 public:
     explicit IntegrationPluginNeato();
+    ~IntegrationPluginNeato() override;
 
     void startPairing(ThingPairingInfo *info) override;
     void confirmPairing(ThingPairingInfo *info, const QString &username, const QString &secret) override;
@@ -42,11 +56,82 @@ public:
     void executeAction(ThingActionInfo *info) override;
     void thingRemoved(Thing *thing) override;
 
+    void browseThing(BrowseResult *result) override;
+    void browserItem(BrowserItemResult *result) override;
+
 private slots:
-    void robotsLoaded();
+    void robotsLoaded(const Neato::RobotListDiff &diff);
+    void robotStateReceived(const QString &robotSerial, const Neato::RobotState &state);
+    void robotStateFailed(const QString &robotSerial, int httpStatus);
+    void pollRobot(const QString &robotSerial);
+    void flushRobotStates();
+    void logMetrics();
+    void hostAvailabilityChanged(const QString &host, bool available);
 
 private:
+    // robot thing values as last pushed to nymea, new states only forward what changed
+    struct RobotView {
+        quint8 robotState = 0; // index into the robotState possibleValues
+        bool charging = false;
+        int batteryLevel = 0;
+        bool batteryCritical = false;
+        QString errorMessage;
+        bool connected = false;
+    };
+
+    // state shown right after a command was accepted, until a poll confirms or contradicts it
+    struct OptimisticState {
+        Neato::RobotState predicted;
+        Neato::RobotState previous;
+        int polls = 0;
+    };
+
+    // map list of one robot, the image urls in it expire after a while
+    struct MapListing {
+        QVector<Neato::MapInfo> maps;
+        QDateTime validUntil;
+    };
+
+    RequestScheduler *requestScheduler();
+    bool isCloudHost(const QString &host) const;
+    Neato::RateLimits rateLimits() const;
+    void discardAccount(const ThingId &thingId);
+    void connectAccount(Neato *n);
+    void accountAuthenticated(Thing *thing, bool authenticated);
+    void accountAvailable(Neato *n, bool available);
+    void startupRobotSettled(const QString &robotSerial);
+    void startPolling(const QString &robotSerial);
+    qint64 accountRank(const ThingId &accountId);
+    void applyCleaningSettings(Thing *robotThing);
+    static RobotView robotView(const Neato::RobotState &state, bool connected);
+    void pushRobotView(Thing *robotThing, const RobotView &view);
+    CommandQueue *commandQueue(const QString &robotSerial);
+    void dispatchCommand(const QString &robotSerial, CommandQueue::Command command, const CommandQueue::Done &done);
+    void applyOptimisticState(const QString &robotSerial, Neato::RobotCommand command);
+    void withMapListing(const QString &robotSerial, Neato::MapKind kind, QObject *context, const std::function<void(const MapListing *listing)> &callback);
+    BrowserItem mapBrowserItem(const QString &itemId, const Neato::MapInfo &map);
+
     QHash<ThingId, Neato *> m_neatoAccounts;
+    QSet<ThingId> m_pendingPairings; // created by startPairing, not set up yet
+    QSet<Neato *> m_sessionAccounts; // authenticated and connected since the last loss of either
+    RobotRegistry m_registry;
+    QHash<QString, Neato::RobotState> m_robotStates;
+    QSet<QString> m_dirtyRobotStates;
+    QHash<ThingId, RobotView> m_robotViews;
+    QHash<QString, CommandQueue *> m_commandQueues;
+    QHash<QString, OptimisticState> m_optimisticStates;
+    QHash<QString, MapListing> m_mapListings;
+    Neato::Endpoints m_endpoints;
+    RequestScheduler *m_requestScheduler = nullptr;
+    MapCache *m_mapCache = nullptr;
+    PollScheduler *m_pollScheduler = nullptr;
+    QTimer *m_stateFlushTimer = nullptr;
+    QTimer *m_metricsTimer = nullptr;
+    BringUpQueue *m_bringUp = nullptr;
+    ReplyDecoder *m_replyDecoder = nullptr;
+    QElapsedTimer m_startupClock;
+    QSet<QString> m_startupRobots; // restored robots that did not report a state since startup
+    bool m_startupReported = false;
 };
 
 #endif // IntegrationPluginNeato_H_INCLUDED
@@ -0,0 +1,177 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef JSONDECODE_H
+#define JSONDECODE_H
+
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonValue>
+#include <QDateTime>
+#include <QString>
+#include <QUrl>
+#include <QVector>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+
+/*!
+  Decoding of JSON objects into plain structs, driven by a field table per struct.
+
+  A struct becomes decodable by specializing JsonDecode::Schema with a constexpr
+  tuple of fields. The table is expanded at compile time into one lookup and one
+  direct conversion per field, nothing goes through QVariant.
+*/
+namespace JsonDecode {
+
+  template<typename Struct, typename T>
+  struct Field {
+    QLatin1String name;
+    T Struct::*member;
+    bool required;
+  };
+
+  // a missing or mistyped required field fails the whole object, other fields keep their default
+  template<typename Struct, typename T, std::size_t N>
+  constexpr Field<Struct, T> field( const char (&name)[N], T Struct::*member, bool required = false )
+  {
+    return Field<Struct, T>{ QLatin1String( name, static_cast<int>(N - 1) ), member, required };
+  }
+
+  // specialize with a constexpr "fields" tuple to make a struct decodable
+  template<typename Struct>
+  struct Schema {};
+
+  // specialize with a constexpr "last" value for enums sent as numeric codes, codes out of range become Invalid
+  template<typename Enum>
+  struct EnumRange;
+
+  template<typename T, typename = void>
+  struct HasSchema : std::false_type {};
+
+  template<typename T>
+  struct HasSchema<T, std::void_t<decltype(Schema<T>::fields)>> : std::true_type {};
+
+  inline bool decodeValue( const QJsonValue &v, QString &out )
+  {
+    if ( !v.isString() )
+      return false;
+    out = v.toString();
+    return true;
+  }
+
+  inline bool decodeValue( const QJsonValue &v, int &out )
+  {
+    if ( !v.isDouble() )
+      return false;
+    out = v.toInt();
+    return true;
+  }
+
+  inline bool decodeValue( const QJsonValue &v, bool &out )
+  {
+    if ( !v.isBool() )
+      return false;
+    out = v.toBool();
+    return true;
+  }
+
+  inline bool decodeValue( const QJsonValue &v, QDateTime &out )
+  {
+    if ( !v.isString() )
+      return false;
+    out = QDateTime::fromString( v.toString(), Qt::ISODate );
+    return out.isValid();
+  }
+
+  inline bool decodeValue( const QJsonValue &v, QUrl &out )
+  {
+    if ( !v.isString() )
+      return false;
+    out = QUrl( v.toString() );
+    return out.isValid();
+  }
+
+  // non string elements are skipped
+  inline bool decodeValue( const QJsonValue &v, QVector<QString> &out )
+  {
+    if ( !v.isArray() )
+      return false;
+    const QJsonArray array = v.toArray();
+    out.clear();
+    out.reserve( array.size() );
+    for ( const QJsonValue &elem : array ) {
+      if ( elem.isString() )
+        out.append( elem.toString() );
+    }
+    return true;
+  }
+
+  template<typename Enum>
+  std::enable_if_t<std::is_enum_v<Enum>, bool> decodeValue( const QJsonValue &v, Enum &out )
+  {
+    if ( !v.isDouble() )
+      return false;
+    const int code = v.toInt();
+    out = code < 0 || code > static_cast<int>(EnumRange<Enum>::last) ? Enum::Invalid : static_cast<Enum>(code);
+    return true;
+  }
+
+  template<typename Struct>
+  std::enable_if_t<HasSchema<Struct>::value, bool> decodeValue( const QJsonValue &v, Struct &out );
+
+  template<typename T>
+  bool decodeValue( const QJsonValue &v, std::optional<T> &out )
+  {
+    T value{};
+    if ( !decodeValue( v, value ) )
+      return false;
+    out = std::move(value);
+    return true;
+  }
+
+  template<typename Struct, typename T>
+  bool decodeField( const QJsonObject &o, Struct &out, const Field<Struct, T> &f )
+  {
+    const auto it = o.constFind( f.name );
+    if ( it == o.constEnd() )
+      return !f.required;
+    const QJsonValue v = it.value();
+    if ( v.isNull() )
+      return !f.required;
+    return decodeValue( v, out.*(f.member) ) || !f.required;
+  }
+
+  template<typename Struct>
+  bool decode( const QJsonObject &o, Struct &out )
+  {
+    return std::apply( [&o, &out]( const auto &...fields ) {
+      return ( decodeField( o, out, fields ) && ... );
+    }, Schema<Struct>::fields );
+  }
+
+  template<typename Struct>
+  std::enable_if_t<HasSchema<Struct>::value, bool> decodeValue( const QJsonValue &v, Struct &out )
+  {
+    return v.isObject() && decode( v.toObject(), out );
+  }
+}
+
+#endif // JSONDECODE_H
@@ -0,0 +1,255 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mapcache.h"
+#include "extern-plugininfo.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QNetworkReply>
+#include <QTimer>
+#include <algorithm>
+#include <utility>
+
+namespace {
+  const QString imageSuffix = QStringLiteral(".png");
+  const QString partialSuffix = QStringLiteral(".part");
+
+  // keep the reply buffer small, data is moved to disk on every readyRead
+  constexpr qint64 readBufferSize = 64 * 1024;
+
+  // access times only order the eviction, losing the last few on a crash does no harm
+  constexpr int accessFlushDelayMs = 30 * 1000;
+}
+
+MapCache::MapCache( RequestScheduler &scheduler, const QString &directory, qint64 maxSize, QObject *parent )
+  : QObject{parent}
+  , m_scheduler( &scheduler )
+  , m_directory( directory )
+  , m_maxSize( maxSize )
+  , m_flushTimer( new QTimer(this) )
+{
+  m_flushTimer->setSingleShot( true );
+  m_flushTimer->setInterval( accessFlushDelayMs );
+  connect( m_flushTimer, &QTimer::timeout, this, &MapCache::flushAccessTimes );
+
+  if ( !m_directory.mkpath( QStringLiteral(".") ) )
+    qCWarning(dcNeato()) << "Can not create map cache directory" << directory;
+
+  m_index = new QSettings( m_directory.filePath( QStringLiteral("index.ini") ), QSettings::IniFormat, this );
+
+  // leftovers of interrupted downloads
+  for ( const QFileInfo &partial : m_directory.entryInfoList( { QLatin1Char('*') + partialSuffix }, QDir::Files ) )
+    QFile::remove( partial.absoluteFilePath() );
+
+  for ( const QFileInfo &image : m_directory.entryInfoList( { QLatin1Char('*') + imageSuffix }, QDir::Files ) ) {
+    const QByteArray hash = image.completeBaseName().toLatin1();
+    Entry e;
+    e.size = image.size();
+    e.lastAccess = m_index->value( QStringLiteral("access/") + hash, image.lastModified().toMSecsSinceEpoch() ).toLongLong();
+    m_entries.insert( hash, e );
+    m_size += e.size;
+  }
+
+  m_index->beginGroup( QStringLiteral("maps") );
+  for ( const QString &mapId : m_index->childKeys() ) {
+    const QByteArray hash = m_index->value( mapId ).toByteArray();
+    if ( m_entries.contains( hash ) )
+      m_mapHashes.insert( mapId, hash );
+  }
+  m_index->endGroup();
+
+  evict();
+}
+
+MapCache::~MapCache()
+{
+  flushAccessTimes();
+
+  // aborting finishes the reply right away, which may hand the next queued download a slot
+  const auto downloads = std::exchange( m_downloads, {} );
+  for ( Download *download : downloads ) {
+    if ( download->reply ) {
+      download->reply->disconnect( this );
+      RequestScheduler::cancel( download->reply );
+    }
+    download->file->remove();
+    delete download;
+  }
+}
+
+QString MapCache::cachedFile( const QString &mapId )
+{
+  const auto hash = m_mapHashes.constFind( mapId );
+  if ( hash == m_mapHashes.constEnd() )
+    return QString();
+
+  touch( *hash );
+  return fileForHash( *hash );
+}
+
+void MapCache::fetch( const QString &mapId, const QUrl &url )
+{
+  if ( m_mapHashes.contains( mapId ) || m_downloads.contains( mapId ) )
+    return;
+
+  auto *download = new Download;
+  download->mapId = mapId;
+  download->file = new QFile( m_directory.filePath( QString::fromLatin1( mapId.toUtf8().toHex() ) + partialSuffix ), this );
+  if ( !download->file->open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
+    qCWarning(dcNeato()) << "Can not write map download" << download->file->fileName();
+    delete download->file;
+    delete download;
+    emit mapFailed( mapId );
+    return;
+  }
+
+  m_downloads.insert( mapId, download );
+
+  m_scheduler->get( RequestScheduler::Priority::MapDownload, QNetworkRequest( url ), this, [this, mapId]( QNetworkReply *reply ) {
+    Download *download = m_downloads.value( mapId );
+    if ( !download ) {
+      RequestScheduler::cancel( reply );
+      reply->deleteLater();
+      return;
+    }
+    download->reply = reply;
+    reply->setReadBufferSize( readBufferSize );
+    connect( reply, &QNetworkReply::finished, reply, &QNetworkReply::deleteLater );
+    connect( reply, &QNetworkReply::readyRead, this, [reply, download] {
+      const QByteArray chunk = reply->readAll();
+      download->hash.addData( chunk );
+      download->file->write( chunk );
+    });
+    connect( reply, &QNetworkReply::finished, this, [this, mapId] {
+      finishDownload( mapId );
+    });
+  });
+}
+
+void MapCache::finishDownload( const QString &mapId )
+{
+  Download *download = m_downloads.take( mapId );
+  if ( !download || !download->reply )
+    return;
+
+  QNetworkReply *reply = download->reply;
+  QFile *file = download->file;
+  const QByteArray rest = reply->readAll();
+  download->hash.addData( rest );
+  file->write( rest );
+  file->close();
+
+  const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if ( status != 200 || reply->error() != QNetworkReply::NoError || file->error() != QFile::NoError ) {
+    qCWarning(dcNeato()) << "Downloading map" << mapId << "failed:" << status << reply->errorString();
+    file->remove();
+    file->deleteLater();
+    delete download;
+    emit mapFailed( mapId );
+    return;
+  }
+
+  const QByteArray hash = download->hash.result().toHex();
+  const QString target = fileForHash( hash );
+  if ( m_entries.contains( hash ) ) {
+    // same content under another map id
+    file->remove();
+  } else if ( file->rename( target ) ) {
+    Entry e;
+    e.size = QFileInfo( target ).size();
+    m_entries.insert( hash, e );
+    m_size += e.size;
+  } else {
+    qCWarning(dcNeato()) << "Can not store map" << mapId << "in the cache";
+    file->remove();
+    file->deleteLater();
+    delete download;
+    emit mapFailed( mapId );
+    return;
+  }
+  file->deleteLater();
+  delete download;
+
+  m_mapHashes.insert( mapId, hash );
+  m_index->setValue( QStringLiteral("maps/") + mapId, hash );
+  touch( hash );
+  evict();
+
+  emit mapCached( mapId, target );
+}
+
+QString MapCache::fileForHash( const QByteArray &hash ) const
+{
+  return m_directory.filePath( QString::fromLatin1( hash ) + imageSuffix );
+}
+
+void MapCache::touch( const QByteArray &hash )
+{
+  auto entry = m_entries.find( hash );
+  if ( entry == m_entries.end() )
+    return;
+  entry->lastAccess = QDateTime::currentMSecsSinceEpoch();
+  m_touched.insert( hash );
+  if ( !m_flushTimer->isActive() )
+    m_flushTimer->start();
+}
+
+void MapCache::flushAccessTimes()
+{
+  m_flushTimer->stop();
+  for ( const QByteArray &hash : qAsConst(m_touched) ) {
+    const auto entry = m_entries.constFind( hash );
+    if ( entry != m_entries.constEnd() )
+      m_index->setValue( QStringLiteral("access/") + hash, entry->lastAccess );
+  }
+  m_touched.clear();
+}
+
+void MapCache::evict()
+{
+  if ( m_size <= m_maxSize )
+    return;
+
+  QVector<QPair<qint64, QByteArray>> byAge;
+  byAge.reserve( m_entries.size() );
+  for ( auto it = m_entries.cbegin(); it != m_entries.cend(); ++it )
+    byAge.append( qMakePair( it->lastAccess, it.key() ) );
+  std::sort( byAge.begin(), byAge.end() );
+
+  for ( const auto &candidate : qAsConst(byAge) ) {
+    if ( m_size <= m_maxSize )
+      break;
+    const QByteArray &hash = candidate.second;
+    QFile::remove( fileForHash( hash ) );
+    m_size -= m_entries.take( hash ).size;
+    m_touched.remove( hash );
+    m_index->remove( QStringLiteral("access/") + hash );
+    for ( auto it = m_mapHashes.begin(); it != m_mapHashes.end(); ) {
+      if ( it.value() == hash ) {
+        m_index->remove( QStringLiteral("maps/") + it.key() );
+        it = m_mapHashes.erase( it );
+      } else {
+        ++it;
+      }
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include "requestscheduler.h"
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QPointer>
+#include <QDir>
+#include <QSettings>
+#include <QCryptographicHash>
+
+class QFile;
+class QTimer;
+
+/*!
+  On-disk cache for robot map images.
+
+  Images are stored under the SHA-256 of their content, so the same floor plan
+  referenced by several map ids is kept only once. Downloads are streamed to disk
+  chunk by chunk while hashing, the image is never held in memory as a whole.
+  The cache is capped in size and evicts the least recently used images. Access
+  times are written to the index in batches, browsing a folder touches every map
+  in it.
+*/
+class MapCache : public QObject
+{
+  Q_OBJECT
+public:
+  explicit MapCache( RequestScheduler &scheduler, const QString &directory, qint64 maxSize, QObject *parent = nullptr );
+  ~MapCache();
+
+  // returns the image file of the map or an empty string if it is not cached yet
+  QString cachedFile( const QString &mapId );
+
+  // starts a download unless the map is already cached or on its way, reports via mapCached or mapFailed
+  void fetch( const QString &mapId, const QUrl &url );
+
+signals:
+  void mapCached( const QString &mapId, const QString &fileName );
+  void mapFailed( const QString &mapId );
+
+private:
+  struct Entry {
+    qint64 size = 0;
+    qint64 lastAccess = 0;
+  };
+
+  struct Download {
+    QString mapId;
+    QPointer<QNetworkReply> reply; // null while waiting for a free slot
+    QFile *file = nullptr;
+    QCryptographicHash hash{ QCryptographicHash::Sha256 };
+  };
+
+  void finishDownload( const QString &mapId );
+  QString fileForHash( const QByteArray &hash ) const;
+  void touch( const QByteArray &hash );
+  void flushAccessTimes();
+  void evict();
+
+  RequestScheduler *m_scheduler = nullptr;
+  QDir m_directory;
+  qint64 m_maxSize = 0;
+  qint64 m_size = 0;
+
+  QSettings *m_index = nullptr;            // map id -> content hash, survives restarts
+  QHash<QString, QByteArray> m_mapHashes;  // map id -> content hash
+  QHash<QByteArray, Entry> m_entries;      // content hash -> file size and last access
+  QHash<QString, Download *> m_downloads; // map id -> running or queued download
+  QSet<QByteArray> m_touched;              // content hashes with an access time not written yet
+  QTimer *m_flushTimer = nullptr;
+};
+
+#endif // MAPCACHE_H
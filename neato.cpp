@@ -20,63 +20,267 @@
 
 #include "neato.h"
 #include "extern-plugininfo.h"
+#include "jsondecode.h"
+#include "neatoreplies.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
-#include <QJsonArray>
 #include <QUrlQuery>
-#include <QTimer>
-
-template<bool flag = false> void constexpr static_no_match() { static_assert(flag, "Static match failed"); }
-
-/*!
-  Small helper function to extract data from QJsonObject's auto converting to the target type
-*/
-template<typename T>
-bool fetchElem ( const QJsonObject &o, const QString &field, T &destination ){
-  const QJsonValue &v = o.value( field );
-  if ( v.isUndefined() ) {
-    qDebug(dcNeato()) << "Robot object misses field: "<< field;
-    return false;
+#include <QLocale>
+#include <QCryptographicHash>
+#include <algorithm>
+#include <chrono>
+
+namespace {
+  // HMAC-SHA256 works on 64 byte blocks
+  constexpr int hmacBlockSize = 64;
+
+  QByteArray hmacPad( const QByteArray &key, char pad )
+  {
+    QByteArray block = key.size() > hmacBlockSize ? QCryptographicHash::hash( key, QCryptographicHash::Sha256 ) : key;
+    block.append( QByteArray( hmacBlockSize - block.size(), '\0' ) );
+    for ( char &c : block )
+      c ^= pad;
+    return block;
   }
 
-  if constexpr ( std::is_same_v<QString, T> ) {
-    destination = o.value(field).toString();
-    return true;
-  } else if constexpr ( std::is_same_v<QDateTime, T> ) {
-    destination = QDateTime::fromString( o.value(field).toString(), Qt::ISODate );
-    return destination.isValid();
-  } else {
-    static_no_match();
-    // unreachable
-    return false;
+  // answer of /oauth2/token, error_description is only set on failure
+  struct TokenResponse {
+    QString accessToken;
+    QString refreshToken;
+    std::optional<int> expiresIn;
+    QString errorDescription;
+  };
+
+  // upper bound of a response body, larger answers are aborted while downloading
+  constexpr qint64 maxBodySize( RequestMetrics::Endpoint endpoint )
+  {
+    switch ( endpoint ) {
+      case RequestMetrics::Endpoint::Token:
+        return 16 * 1024;
+      case RequestMetrics::Endpoint::Robots:
+        return 1024 * 1024;
+      case RequestMetrics::Endpoint::RobotMessages:
+        return 64 * 1024;
+      case RequestMetrics::Endpoint::Maps:
+        return 256 * 1024;
+    }
+    return 64 * 1024;
+  }
+
+  void limitBodySize( QNetworkReply *reply, RequestMetrics::Endpoint endpoint )
+  {
+    const qint64 cap = maxBodySize( endpoint );
+    QObject::connect( reply, &QNetworkReply::downloadProgress, reply, [reply, cap]( qint64 received, qint64 total ) {
+      if ( received > cap || total > cap ) {
+        // the host answered, an oversized body must not count against its breaker
+        qCWarning(dcNeato()) << "Response of" << reply->url().path() << "exceeds" << cap << "bytes, aborting";
+        RequestScheduler::cancel( reply );
+      }
+    });
+  }
+
+  // the body is read from the reply buffer exactly once
+  bool parseBody( QNetworkReply *reply, QJsonDocument &document )
+  {
+    QJsonParseError error;
+    document = QJsonDocument::fromJson( reply->readAll(), &error );
+    return error.error == QJsonParseError::NoError;
+  }
+
+  constexpr Neato::Capabilities traitCapabilities = Neato::Capability::PersistentMaps;
+
+  Neato::Capabilities capabilitiesFromTraits( const QVector<QString> &traits )
+  {
+    Neato::Capabilities caps;
+    if ( traits.contains( QLatin1String("maps") ) )
+      caps |= Neato::Capability::PersistentMaps;
+    return caps;
+  }
+
+  Neato::Capabilities capabilitiesFromServices( const NeatoReplies::ServiceVersions &services )
+  {
+    Neato::Capabilities caps = Neato::Capability::ServicesKnown;
+    const QString &house = services.houseCleaning;
+    if ( house == QLatin1String("basic-1") )
+      caps |= Neato::Capability::HouseCleaningModes;
+    else if ( house.startsWith( QLatin1String("basic-") ) )
+      caps |= Neato::Capability::HouseCleaningModes | Neato::Capability::NavigationModes;
+    else if ( house.startsWith( QLatin1String("minimal-") ) && house != QLatin1String("minimal-1") )
+      caps |= Neato::Capability::NavigationModes;
+    if ( !services.maps.isEmpty() )
+      caps |= Neato::Capability::CleaningMaps;
+    return caps;
+  }
+
+  QByteArray buildStartCleaningBody( Neato::Capabilities caps, const Neato::CleaningSettings &settings )
+  {
+    // category 4 cleans along the floor plan and its no-go lines, 2 is a plain house cleaning
+    const bool persistent = settings.noGoLines && caps.testFlag( Neato::Capability::PersistentMaps );
+    const bool allParams = !caps.testFlag( Neato::Capability::ServicesKnown );
+
+    // until the robot reported its services, send what most houseCleaning service versions understand
+    QByteArray body = QByteArrayLiteral(R"({"reqId":"1","cmd":"startCleaning","params":{"category":)");
+    body += persistent ? '4' : '2';
+    if ( allParams || caps.testFlag( Neato::Capability::HouseCleaningModes ) ) {
+      body += QByteArrayLiteral(R"(,"mode":)");
+      body += settings.eco ? '1' : '2';
+      body += QByteArrayLiteral(R"(,"modifier":1)");
+    }
+    if ( allParams || caps.testFlag( Neato::Capability::NavigationModes ) ) {
+      body += QByteArrayLiteral(R"(,"navigationMode":)");
+      body += settings.care ? '2' : '1';
+    }
+    body += QByteArrayLiteral("}}");
+    return body;
+  }
+
+  int liveInstances = 0;
+
+  // concurrent requests per host, commands and polls of many robots go to the nucleo host
+  constexpr int beehiveHostLimit = 4;
+  constexpr int nucleoHostLimit = 6;
+
+  // refresh a bit before the token runs out, a request may take a while to reach the server
+  constexpr qint64 tokenExpiryMargin = 20 * 1000;
+
+  // budget kept for commands, polls are shed before they could use it
+  constexpr double commandReserve = 1;
+
+  // how long polls pause after a 429 without Retry-After, and at most
+  constexpr std::chrono::milliseconds quotaPause = std::chrono::minutes(1);
+  constexpr std::chrono::milliseconds maxQuotaPause = std::chrono::minutes(15);
+
+  // allow bursts of about ten seconds worth of requests
+  double burstFor( int perMinute )
+  {
+    return std::max( 2.0, perMinute / 6.0 );
+  }
+
+  // joins a base url, which may carry a path prefix, with an absolute api path
+  QUrl appendPath( QUrl url, const QString &path )
+  {
+    if ( path.isEmpty() )
+      return url;
+
+    QString base = url.path();
+    if ( base.endsWith( QLatin1Char('/') ) )
+      base.chop( 1 );
+    url.setPath( base + path );
+    return url;
   }
-};
+}
+
+namespace JsonDecode {
+  template<> struct Schema<TokenResponse> {
+    static constexpr auto fields = std::make_tuple(
+      field( "access_token",      &TokenResponse::accessToken ),
+      field( "refresh_token",     &TokenResponse::refreshToken ),
+      field( "expires_in",        &TokenResponse::expiresIn ),
+      field( "error_description", &TokenResponse::errorDescription )
+    );
+  };
+}
+
+Neato::Endpoints Neato::Endpoints::fromEnvironment()
+{
+  Endpoints endpoints;
+  auto override = []( const char *name, QUrl &url ) {
+    const QString value = qEnvironmentVariable( name );
+    if ( value.isEmpty() )
+      return;
+    const QUrl custom( value );
+    if ( custom.isValid() && !custom.host().isEmpty() ) {
+      qCDebug(dcNeato()) << "Using" << custom << "from" << name;
+      url = custom;
+    } else {
+      qCWarning(dcNeato()) << "Ignoring invalid url in" << name << value;
+    }
+  };
+  override( "NEATO_AUTHORIZE_URL", endpoints.authorize );
+  override( "NEATO_BEEHIVE_URL", endpoints.beehive );
+  override( "NEATO_NUCLEO_URL", endpoints.nucleo );
+  return endpoints;
+}
 
+void Neato::Endpoints::applyHostLimits( RequestScheduler &scheduler ) const
+{
+  scheduler.setHostLimit( RequestScheduler::hostKey( beehive ), beehiveHostLimit );
+  scheduler.setHostLimit( RequestScheduler::hostKey( nucleo ), nucleoHostLimit );
+}
 
-Neato::Neato( NetworkAccessManager &nwAccess, const QByteArray &clientId, const QByteArray &clientSecret, QObject *parent )
+Neato::Neato( RequestScheduler &scheduler, ReplyDecoder &decoder, const Endpoints &endpoints, const QByteArray &clientId, const QByteArray &clientSecret, QObject *parent )
   : QObject{parent}
-  , m_networkManager( &nwAccess )
-  , m_tokenTimeout( new QTimer(this) )
+  , m_scheduler( &scheduler )
+  , m_decoder( &decoder )
+  , m_endpoints( endpoints )
+  , m_lifetime( new QObject(this) )
+  , m_tokenTimeout( new ClockTimer(scheduler.clock(), this) )
+  , m_tokenRetry( new ClockTimer(scheduler.clock(), this) )
+  , m_robotsRetry( new ClockTimer(scheduler.clock(), this) )
   , m_clientId( clientId )
   , m_clientSecret( clientSecret )
   , m_redirectUri( QByteArrayLiteral("https://127.0.0.1:8888") )
 {
+  ++liveInstances;
+  setRateLimits( RateLimits() );
   m_tokenTimeout->setSingleShot(true);
-  connect( m_tokenTimeout, &QTimer::timeout, this, [this](){
+  connect( m_tokenTimeout, &ClockTimer::timeout, this, [this](){
     qCDebug(dcNeato) << "Refresh authentication token";
     this->fetchAcessTokenFromRefreshToken( this->m_refreshToken );
   });
+
+  m_tokenRetry->setSingleShot(true);
+  connect( m_tokenRetry, &ClockTimer::timeout, this, [this](){
+    // the backoff kept the token request pending, so requests issued meanwhile stayed parked
+    m_tokenPending = false;
+    fetchAcessTokenFromRefreshToken( m_refreshToken );
+  });
+
+  m_robotsRetry->setSingleShot(true);
+  connect( m_robotsRetry, &ClockTimer::timeout, this, &Neato::loadRobots );
 }
 
 Neato::~Neato()
 {
+  --liveInstances;
+}
+
+int Neato::instanceCount()
+{
+  return liveInstances;
+}
+
+RequestMetrics &Neato::metrics()
+{
+  return m_metrics;
+}
+
+void Neato::setRateLimits( const RateLimits &limits )
+{
+  m_rateLimits = limits;
+  m_accountBucket.configure( limits.accountPerMinute, burstFor( limits.accountPerMinute ) );
+  for ( auto &bucket : m_robotBuckets )
+    bucket.configure( limits.robotPerMinute, burstFor( limits.robotPerMinute ) );
+}
+
+TokenBucket &Neato::robotBucket( const QString &robotSerial )
+{
+  auto bucket = m_robotBuckets.find( robotSerial );
+  if ( bucket == m_robotBuckets.end() )
+    bucket = m_robotBuckets.insert( robotSerial, TokenBucket( m_rateLimits.robotPerMinute, burstFor( m_rateLimits.robotPerMinute ) ) );
+  return *bucket;
+}
+
+QStringList Neato::dumpTrace() const
+{
+  return m_trace.dump( m_scheduler->clock().now() );
 }
 
 QUrl Neato::loginUrl() const
 {
     // Compose the OAuth url. Make sure to start the callback/redirect URL with https://127.0.0.1
-    QUrl url("https://apps.neatorobotics.com/oauth2/authorize");
+    QUrl url(m_endpoints.authorize);
     QUrlQuery queryParams;
     queryParams.addQueryItem("client_id", m_clientId);
     queryParams.addQueryItem("redirect_uri", m_redirectUri.toPercentEncoding() );
@@ -99,39 +303,57 @@ QString Neato::refreshToken()
 
 void Neato::handleTokenReply( QNetworkReply *reply )
 {
-  QJsonDocument jsonDoc = QJsonDocument::fromJson(reply->readAll());
-  const auto &variantMap = jsonDoc.toVariant().toMap();
-
   int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if ( m_tokenIsRefresh && RequestScheduler::isTransientFailure( reply ) ) {
+      // the cloud is unreachable or overloaded, the refresh token is still good
+      std::chrono::milliseconds delay = m_tokenBackoff.next();
+      if ( const auto serverDelay = RequestScheduler::retryAfter( reply ) )
+          delay = std::max( delay, *serverDelay );
+      qCWarning(dcNeato()) << "Token refresh failed temporarily:" << status << reply->errorString() << "retrying in" << delay.count() << "ms";
+      m_tokenPending = true;
+      m_tokenRetry->start( delay );
+      setState( State::Disconnected );
+      emit connectionChanged(false);
+      return;
+  }
+  m_tokenBackoff.reset();
+
+  QJsonDocument data;
+  TokenResponse token;
+  const bool parsed = parseBody( reply, data ) && JsonDecode::decode( data.object(), token );
+
   if (status != 200 || reply->error() != QNetworkReply::NoError) {
-      if(variantMap.contains("error_description")) {
-          qWarning(dcNeato()) << "Access token error:" << variantMap.value("error_description").toString();
+      if ( !token.errorDescription.isEmpty() ) {
+          qWarning(dcNeato()) << "Access token error:" << token.errorDescription;
       }
       setState( State::Disconnected );
+      replayParkedRequests(false);
       emit authenticated(false);
       return;
   }
 
-
-  if ( !variantMap.contains("access_token") || !variantMap.contains("refresh_token")) {
+  if ( !parsed || token.accessToken.isEmpty() || token.refreshToken.isEmpty() ) {
       qWarning(dcNeato()) << "Auth error: token missing from answer";
       setState( State::Disconnected );
+      replayParkedRequests(false);
       emit authenticated(false);
       return;
   }
-  // If successful, extract the tokens
-  this->m_accessToken  = variantMap.value("access_token").toByteArray();
-  this->m_refreshToken = variantMap.value("refresh_token").toByteArray();
+  // If successful, take over the tokens
+  m_accessToken  = std::move( token.accessToken );
+  m_refreshToken = std::move( token.refreshToken );
 
-  if ( variantMap.contains("expires_in") ) {
-    int expiryTime = variantMap.value("expires_in").toInt();
+  if ( token.expiresIn ) {
+    const int expiryTime = *token.expiresIn;
     qCDebug(dcNeato()) << "Access token expires at" << QDateTime::currentDateTime().addSecs(expiryTime).toString();
+    m_tokenExpiresAt = m_scheduler->clock().now() + qint64(expiryTime) * 1000;
     if ( this->m_tokenTimeout )
-      this->m_tokenTimeout->start( std::chrono::seconds(std::max(0, expiryTime - 20)) );
+      this->m_tokenTimeout->start( std::chrono::milliseconds(std::max<qint64>(0, qint64(expiryTime) * 1000 - tokenExpiryMargin)) );
     else
       qWarning(dcNeato()) << "Token refresh timer not initialized";
   }
   setState( State::Connected );
+  replayParkedRequests(true);
   emit authenticated(true);
 }
 
@@ -140,7 +362,7 @@ void Neato::fetchAcessTokenFromAuthorizationCode( const QString &authorizationCo
   setState( State::Authenticating );
   QUrl url = beehiveRequestUrl("/oauth2/token");
 
-  qCDebug(dcNeato()) << "Requesting new token via authorizationCode mechanism: " << authorizationCode;
+  qCDebug(dcNeato()) << "Requesting new token via authorizationCode mechanism";
 
   QUrlQuery query;
   query.addQueryItem("code", authorizationCode);
@@ -153,11 +375,9 @@ void Neato::fetchAcessTokenFromAuthorizationCode( const QString &authorizationCo
   QNetworkRequest request(url);
 
   // Send the request
-  QNetworkReply *reply = m_networkManager->post(request, QByteArray());
-  connect(reply, &QNetworkReply::finished, reply, &QNetworkReply::deleteLater);
-  connect(reply, &QNetworkReply::finished, this, [this, reply](){
-    handleTokenReply(reply);
-  });
+  m_tokenRetry->stop();
+  m_tokenIsRefresh = false;
+  sendTokenRequest( request, QByteArray() );
 }
 
 void Neato::fetchAcessTokenFromRefreshToken( const QString &refreshToken )
@@ -168,7 +388,13 @@ void Neato::fetchAcessTokenFromRefreshToken( const QString &refreshToken )
         return;
     }
 
-    qCDebug(dcNeato()) << "Requesting new token via refreshToken mechanism: " << refreshToken;
+    if (m_tokenPending) {
+        // single flight, the running request will emit authenticated() for everyone
+        qCDebug(dcNeato()) << "Token request already in flight, not refreshing again";
+        return;
+    }
+
+    qCDebug(dcNeato()) << "Requesting new token via refreshToken mechanism";
 
     QUrl url = beehiveRequestUrl("/oauth2/token");
 
@@ -189,58 +415,232 @@ void Neato::fetchAcessTokenFromRefreshToken( const QString &refreshToken )
     //QByteArray auth = QByteArray(m_clientId + ':' + m_clientSecret).toBase64(QByteArray::Base64Encoding | QByteArray::KeepTrailingEquals);
     //request.setRawHeader("Authorization", QString("Basic %1").arg(QString(auth)).toUtf8());
 
-    QNetworkReply *reply = m_networkManager->post(request, data.toUtf8());
+    m_tokenIsRefresh = true;
+    sendTokenRequest(request, data.toUtf8());
+}
+
+void Neato::sendTokenRequest( const QNetworkRequest &request, const QByteArray &body )
+{
+  if ( m_tokenReply ) {
+    // a newer token request replaces the running one, e.g. when re-pairing
+    m_tokenReply->disconnect( m_lifetime );
+    RequestScheduler::cancel( m_tokenReply );
+  }
+
+  const quint32 generation = ++m_tokenGeneration;
+  m_tokenPending = true;
+  m_scheduler->post( RequestScheduler::Priority::TokenRefresh, request, body, m_lifetime, [this, generation]( QNetworkReply *reply ) {
     connect(reply, &QNetworkReply::finished, reply, &QNetworkReply::deleteLater);
-    connect(reply, &QNetworkReply::finished, this, [this, reply](){
+    if ( generation != m_tokenGeneration ) {
+      // superseded while waiting for a free slot
+      RequestScheduler::cancel( reply );
+      return;
+    }
+
+    m_tokenReply = reply;
+    limitBodySize( reply, RequestMetrics::Endpoint::Token );
+    const quint32 requestId = ++m_nextRequestId;
+    const qint64 startedAt = m_scheduler->clock().now();
+    connect(reply, &QNetworkReply::finished, m_lifetime, [this, requestId, startedAt, reply](){
+      recordRequest( { RequestMetrics::Endpoint::Token }, requestId, startedAt, reply );
+      m_tokenReply = nullptr;
+      m_tokenPending = false;
       handleTokenReply(reply);
     });
+  });
 }
 
-void Neato::loadRobots()
+void Neato::recordRequest( const RequestTag &tag, quint32 requestId, qint64 startedAt, QNetworkReply *reply )
+{
+  const qint64 now = m_scheduler->clock().now();
+  const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  m_metrics.record( tag.endpoint, status, now - startedAt );
+
+  TraceBuffer::Event event;
+  event.requestId = requestId;
+  event.finishedAt = now;
+  event.durationMs = static_cast<quint32>( now - startedAt );
+  event.serialHash = tag.serialHash;
+  event.httpStatus = static_cast<qint16>( status );
+  event.endpoint = tag.endpoint;
+  m_trace.record( event );
+}
+
+void Neato::quotaExceeded( const RequestTag &tag, QNetworkReply *reply )
+{
+  // the quota belongs to the robot or the account, polls are shed until it refilled while commands still go out
+  const std::chrono::milliseconds delay = std::min( RequestScheduler::retryAfter( reply ).value_or( quotaPause ), maxQuotaPause );
+  const qint64 now = m_scheduler->clock().now();
+  if ( tag.robotSerial.isEmpty() ) {
+    qCWarning(dcNeato()) << "Account request quota used up, holding back polls for" << delay.count() << "ms";
+    m_accountBucket.drainUntil( now, now + delay.count() );
+  } else {
+    qCWarning(dcNeato()) << "Request quota of robot" << tag.robotSerial << "used up, holding back polls for" << delay.count() << "ms";
+    robotBucket( tag.robotSerial ).drainUntil( now, now + delay.count() );
+  }
+}
+
+QObject *Neato::lifetime( const RequestTag &tag )
+{
+  if ( !m_lifetime || tag.robotSerial.isEmpty() )
+    return m_lifetime;
+
+  QObject *&robot = m_robotLifetimes[ tag.robotSerial ];
+  if ( !robot )
+    robot = new QObject( m_lifetime );
+  return robot;
+}
+
+void Neato::submit( const RequestTag &tag, RequestScheduler::Priority priority, const QByteArray &verb, const QNetworkRequest &request, const QByteArray &body, const ReplyHandler &handler )
+{
+  // a cancelled account drops the request in the scheduler
+  QObject *context = lifetime( tag );
+  auto started = [this, tag, context, handler]( QNetworkReply *reply ) {
+    limitBodySize( reply, tag.endpoint );
+    const quint32 requestId = ++m_nextRequestId;
+    const qint64 startedAt = m_scheduler->clock().now();
+    connect(reply, &QNetworkReply::finished, reply, &QNetworkReply::deleteLater);
+    connect(reply, &QNetworkReply::finished, context, [this, tag, requestId, startedAt, reply, handler] {
+      recordRequest( tag, requestId, startedAt, reply );
+      if ( reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 429 )
+        quotaExceeded( tag, reply );
+      handler( reply );
+    });
+  };
+
+  if ( verb == "POST" )
+    m_scheduler->post( priority, request, body, context, started );
+  else
+    m_scheduler->get( priority, request, context, started );
+}
+
+void Neato::cancelRobotRequests( const QString &robotSerial )
+{
+  delete m_robotLifetimes.take( robotSerial );
+
+  // parked requests would otherwise replay after the next refresh and revive the robot's lifetime
+  m_parkedRequests.erase( std::remove_if( m_parkedRequests.begin(), m_parkedRequests.end(), [&robotSerial]( const ParkedRequest &parked ) {
+    return parked.robotSerial == robotSerial;
+  }), m_parkedRequests.end() );
+}
+
+void Neato::cancel()
 {
-    QNetworkRequest request;
-    request.setHeader   (QNetworkRequest::KnownHeaders::ContentTypeHeader, "application/json");
-    request.setRawHeader("Accept", "application/vnd.neato.beehive.v1+json");
-    request.setRawHeader("Authorization", ("Bearer " + m_accessToken).toLatin1() );
-    request.setUrl( beehiveRequestUrl("/users/me/robots") );
+  m_tokenTimeout->stop();
+  m_tokenRetry->stop();
+  m_robotsRetry->stop();
+  m_parkedRequests.clear();
+
+  // the robot lifetimes are children of the account lifetime
+  m_robotLifetimes.clear();
+  delete m_lifetime;
+}
 
-    QNetworkReply *reply = m_networkManager->get(request);
-    qDebug(dcNeato()) << "Sending request" << request.url() << request.rawHeaderList() << request.rawHeader("Authorization");
+void Neato::beehiveGet( const RequestTag &tag, RequestScheduler::Priority priority, const QString &path, const ReplyHandler &handler, const QByteArray &etag, bool isReplay )
+{
+  if ( m_tokenPending ) {
+    // the token is about to change, send once we have the new one
+    m_parkedRequests.append( { tag.robotSerial, [this, tag, priority, path, handler, etag]() { beehiveGet( tag, priority, path, handler, etag, true ); } } );
+    return;
+  }
 
-    connect(reply, &QNetworkReply::finished, this, [reply, this] {
-        reply->deleteLater();
+  if ( !isReplay && m_tokenExpiresAt && m_scheduler->clock().now() >= m_tokenExpiresAt - tokenExpiryMargin && !m_refreshToken.isEmpty() ) {
+    // the refresh timer did not fire in time, e.g. after a suspend, refresh before sending
+    qCDebug(dcNeato()) << "Access token expired, refreshing before sending" << path;
+    m_parkedRequests.append( { tag.robotSerial, [this, tag, priority, path, handler, etag]() { beehiveGet( tag, priority, path, handler, etag, true ); } } );
+    fetchAcessTokenFromRefreshToken( m_refreshToken );
+    return;
+  }
+
+  m_accountBucket.take( m_scheduler->clock().now() );
+
+  QNetworkRequest request;
+  request.setHeader   (QNetworkRequest::KnownHeaders::ContentTypeHeader, "application/json");
+  request.setRawHeader("Accept", "application/vnd.neato.beehive.v1+json");
+  request.setRawHeader("Authorization", ("Bearer " + m_accessToken).toLatin1() );
+  request.setUrl( beehiveRequestUrl(path) );
+  if ( !etag.isEmpty() )
+    request.setRawHeader("If-None-Match", etag);
+
+  submit( tag, priority, QByteArrayLiteral("GET"), request, QByteArray(), [this, tag, priority, path, handler, etag, isReplay]( QNetworkReply *reply ) {
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if ( status == 401 && !isReplay && !m_refreshToken.isEmpty() ) {
+      // access token expired early or was revoked, park the request and refresh once
+      qCDebug(dcNeato()) << "Access token rejected, refreshing before retrying" << path;
+      m_parkedRequests.append( { tag.robotSerial, [this, tag, priority, path, handler, etag]() { beehiveGet( tag, priority, path, handler, etag, true ); } } );
+      fetchAcessTokenFromRefreshToken( m_refreshToken );
+      return;
+    }
+    handler( reply );
+  });
+}
+
+void Neato::replayParkedRequests( bool tokenValid )
+{
+  QVector<ParkedRequest> parked;
+  parked.swap( m_parkedRequests );
+  if ( parked.isEmpty() )
+    return;
+
+  if ( !tokenValid ) {
+    qCWarning(dcNeato()) << "Dropping" << parked.size() << "requests, no valid access token";
+    emit authenticationStatusChanged(false);
+    return;
+  }
+
+  qCDebug(dcNeato()) << "Replaying" << parked.size() << "requests with the new access token";
+  for ( const ParkedRequest &request : qAsConst(parked) )
+    request.replay();
+}
+
+void Neato::loadRobots()
+{
+    beehiveGet( { RequestMetrics::Endpoint::Robots }, RequestScheduler::Priority::RobotList, QStringLiteral("/users/me/robots"), [this]( QNetworkReply *reply ) {
         int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 
+        if ( RequestScheduler::isTransientFailure( reply ) ) {
+            // keep the robots we know and try again later, the list only changes when robots are (un)linked
+            std::chrono::milliseconds delay = m_robotsBackoff.next();
+            if ( const auto serverDelay = RequestScheduler::retryAfter( reply ) )
+                delay = std::max( delay, *serverDelay );
+            qCWarning(dcNeato()) << "Loading the robot list failed:" << status << reply->errorString() << "retrying in" << delay.count() << "ms";
+            m_robotsRetry->start( delay );
+            emit connectionChanged(false);
+            emit robotsLoadFinished(false);
+            return;
+        }
+        m_robotsBackoff.reset();
+
+        if (status == 304) {
+            // robot list did not change since the one we already have
+            qCDebug(dcNeato()) << "Robot list unchanged";
+            emit connectionChanged(true);
+            emit authenticationStatusChanged(true);
+            emit robotsLoadFinished(true);
+            return;
+        }
+
         // Check HTTP status code
         if (status != 200 || reply->error() != QNetworkReply::NoError) {
-            if (reply->error() == QNetworkReply::HostNotFoundError) {
-                emit connectionChanged(false);
-            }
             if (status == 400 || status == 401) {
                 emit authenticationStatusChanged(false);
             }
 
             // beehive gives us a JSON Object with the error info
-            QJsonParseError error;
-            QJsonDocument data = QJsonDocument::fromJson(reply->readAll(), &error);
-            if (error.error != QJsonParseError::NoError) {
+            QJsonDocument data;
+            if ( !parseBody( reply, data ) ) {
               qCWarning(dcNeato()) << "Request error:" << status << reply->errorString();
+              emit robotsLoadFinished(false);
               return;
             }
 
-            qCWarning(dcNeato()) << "Request error:" << status << reply->errorString() << " Beehive message: " << data.object().value("message").toString();
+            qCWarning(dcNeato()) << "Request error:" << status << reply->errorString() << " Beehive message: " << data.object().value(QLatin1String("message")).toString();
+            emit robotsLoadFinished(false);
             return;
         }
         emit connectionChanged(true);
         emit authenticationStatusChanged(true);
 
-        QJsonParseError error;
-        QJsonDocument data = QJsonDocument::fromJson(reply->readAll(), &error);
-        if (error.error != QJsonParseError::NoError) {
-            qDebug(dcNeato()) << "Robot list: Received invalid response";
-            return;
-        }
-
         /*
         Beehive API gives us a list of robot objects:
         [
@@ -257,26 +657,29 @@ void Neato::loadRobots()
         ]
         */
 
-        m_robots.clear();
-        for ( const auto &elem : data.array() ) {
-          if ( !elem.isObject() ) {
-            qDebug(dcNeato()) << "Robot list: Ignoring non object element";
-            continue;
+        // the reply is gone once the list is decoded, take what is needed from it now
+        const QByteArray etag = reply->rawHeader("ETag");
+        const quint32 generation = ++m_robotsGeneration;
+        m_decoder->run( m_lifetime, [body = reply->readAll()]() { return NeatoReplies::decodeRobots( body ); },
+                        [this, etag, generation]( std::optional<QVector<Robot>> &&robots ) {
+          if ( generation != m_robotsGeneration ) {
+            // a newer list was decoded meanwhile
+            return;
           }
-          Robot r;
-          const QJsonObject &o = elem.toObject();
-          if ( !fetchElem( o, "serial", r.serial ) )          continue;
-          if ( !fetchElem( o, "prefix", r.prefix ) )          continue;
-          if ( !fetchElem( o, "name", r.name ) )              continue;
-          if ( !fetchElem( o, "model", r.model ) )            continue;
-          if ( !fetchElem( o, "secret_key", r.secret_key ) )  continue;
-          fetchElem( o, "linked_at", r.linked_at );
-          fetchElem( o, "purchased_at", r.purchased_at );
-          // ignoring the traits element for now
-          m_robots.append( std::move(r) );
-        }
-        emit robotsLoaded( );
-    });
+          if ( !robots ) {
+            qDebug(dcNeato()) << "Robot list: Received invalid response";
+            emit robotsLoadFinished(false);
+            return;
+          }
+
+          const RobotListDiff diff = diffRobots( m_robots, *robots );
+          m_robots = std::move(*robots);
+          m_robotsETag = etag;
+          updateNucleoContexts( diff );
+          emit robotsLoaded( diff );
+          emit robotsLoadFinished(true);
+        });
+    }, m_robots.isEmpty() ? QByteArray() : m_robotsETag );
 }
 
 const QVector<Neato::Robot> &Neato::robots() const
@@ -284,6 +687,335 @@ const QVector<Neato::Robot> &Neato::robots() const
   return m_robots;
 }
 
+void Neato::restoreRobots( const QVector<Robot> &robots, const QByteArray &etag )
+{
+  const RobotListDiff diff = diffRobots( m_robots, robots );
+  m_robots = robots;
+  m_robotsETag = etag;
+  updateNucleoContexts( diff );
+}
+
+QByteArray Neato::robotsETag() const
+{
+  return m_robotsETag;
+}
+
+void Neato::pollRobotState( const QString &robotSerial )
+{
+  const auto ctx = m_nucleoContexts.constFind( robotSerial );
+  if ( ctx == m_nucleoContexts.constEnd() ) {
+    qCWarning(dcNeato()) << "Can not poll unknown robot" << robotSerial;
+    emit robotStateFailed( robotSerial, 0 );
+    return;
+  }
+
+  // polls must leave the reserve for commands, in the account and in the robot budget
+  const qint64 now = m_scheduler->clock().now();
+  TokenBucket &bucket = robotBucket( robotSerial );
+  const qint64 wait = std::max( m_accountBucket.waitTime( now, commandReserve ), bucket.waitTime( now, commandReserve ) );
+  if ( wait > 0 ) {
+    m_metrics.recordShed( RequestMetrics::Endpoint::RobotMessages );
+    emit robotStatePollShed( robotSerial, wait );
+    return;
+  }
+  m_accountBucket.take( now );
+  bucket.take( now );
+
+  const quint32 sequence = ++m_stateSequences[ robotSerial ].sent;
+  static const QByteArray getRobotStateBody = QByteArrayLiteral(R"({"reqId":"1","cmd":"getRobotState"})");
+  sendNucleoMessage( *ctx, getRobotStateBody, RequestScheduler::Priority::StatePoll, [this, robotSerial, sequence, tag = RequestTag{ RequestMetrics::Endpoint::RobotMessages, ctx->serialHash, ctx->serial }]( QNetworkReply *reply ) {
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (status != 200 || reply->error() != QNetworkReply::NoError) {
+      // nucleo answers with 404 if the robot is not connected to the cloud
+      qCDebug(dcNeato()) << "Robot state request failed for" << robotSerial << status << reply->errorString();
+      emit robotStateFailed( robotSerial, status );
+      return;
+    }
+
+    /*
+    Nucleo answers with the robot state object:
+    {
+      "version": 1, "reqId": "1", "result": "ok", "error": "ui_alert_invalid", "alert": null,
+      "state": 1, "action": 0,
+      "cleaning": { "category": 2, "mode": 1, "modifier": 1, "navigationMode": 1, "spotWidth": 0, "spotHeight": 0 },
+      "details": { "isCharging": false, "isDocked": true, "isScheduleEnabled": false, "dockHasBeenSeen": false, "charge": 98 },
+      "availableCommands": { "start": true, "stop": false, "pause": false, "resume": false, "goToBase": false },
+      "availableServices": { "houseCleaning": "basic-3", "maps": "basic-2", ... },
+      "meta": { "modelName": "BotVacD7Connected", "firmware": "4.5.3-189" }
+    }
+    */
+    m_decoder->run( lifetime( tag ), [body = reply->readAll()]() { return NeatoReplies::decodeStateReply( body ); },
+                    [this, robotSerial, sequence, status]( NeatoReplies::StateReply &&decoded ) {
+      // replies and decodes can finish out of order, never go back to an older state
+      StateSequence &order = m_stateSequences[ robotSerial ];
+      if ( sequence <= order.applied ) {
+        qCDebug(dcNeato()) << "Dropping outdated state of" << robotSerial << sequence << "applied" << order.applied;
+        return;
+      }
+
+      if ( !decoded.valid ) {
+        qCWarning(dcNeato()) << "Robot state: Received invalid response for" << robotSerial;
+        emit robotStateFailed( robotSerial, status );
+        return;
+      }
+      order.applied = sequence;
+
+      if ( decoded.services ) {
+        const Capabilities caps = capabilities( robotSerial );
+        const Capabilities updated = ( caps & traitCapabilities ) | capabilitiesFromServices( *decoded.services );
+        if ( updated != caps ) {
+          qCDebug(dcNeato()) << "Robot" << robotSerial << "services" << decoded.services->houseCleaning << decoded.services->maps;
+          updateCapabilities( robotSerial, updated );
+        }
+      }
+      emit robotStateReceived( robotSerial, decoded.state );
+    });
+  });
+}
+
+void Neato::sendRobotCommand( const QString &robotSerial, RobotCommand command, const CommandHandler &handler )
+{
+  const auto ctx = m_nucleoContexts.constFind( robotSerial );
+  if ( ctx == m_nucleoContexts.constEnd() ) {
+    qCWarning(dcNeato()) << "Can not send command to unknown robot" << robotSerial;
+    handler( false, 0 );
+    return;
+  }
+
+  QByteArray body;
+  switch ( command ) {
+    case RobotCommand::StartCleaning:
+      body = startCleaningBody( robotSerial );
+      break;
+    case RobotCommand::PauseCleaning:
+      body = QByteArrayLiteral(R"({"reqId":"1","cmd":"pauseCleaning"})");
+      break;
+    case RobotCommand::ResumeCleaning:
+      body = QByteArrayLiteral(R"({"reqId":"1","cmd":"resumeCleaning"})");
+      break;
+    case RobotCommand::StopCleaning:
+      body = QByteArrayLiteral(R"({"reqId":"1","cmd":"stopCleaning"})");
+      break;
+    case RobotCommand::SendToBase:
+      body = QByteArrayLiteral(R"({"reqId":"1","cmd":"sendToBase"})");
+      break;
+  }
+
+  // commands are never shed, they only use up budget
+  const qint64 now = m_scheduler->clock().now();
+  m_accountBucket.take( now );
+  robotBucket( robotSerial ).take( now );
+
+  sendNucleoMessage( *ctx, body, RequestScheduler::Priority::Command, [robotSerial, handler]( QNetworkReply *reply ) {
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (status != 200 || reply->error() != QNetworkReply::NoError) {
+      qCWarning(dcNeato()) << "Robot command failed for" << robotSerial << status << reply->errorString();
+      handler( false, status );
+      return;
+    }
+
+    // the robot answers { "version": 1, "reqId": "1", "result": "ok" } or names the reason in result
+    QJsonDocument data;
+    parseBody( reply, data );
+    const QString result = data.object().value(QLatin1String("result")).toString();
+    if ( result != QLatin1String("ok") ) {
+      qCWarning(dcNeato()) << "Robot" << robotSerial << "rejected command:" << result;
+      handler( false, status );
+      return;
+    }
+    handler( true, status );
+  });
+}
+
+Neato::Capabilities Neato::capabilities( const QString &robotSerial ) const
+{
+  return m_capabilities.value( robotSerial );
+}
+
+void Neato::setCleaningSettings( const QString &robotSerial, const CleaningSettings &settings )
+{
+  m_cleaningSettings.insert( robotSerial, settings );
+  m_startCleaningBodies.insert( robotSerial, buildStartCleaningBody( capabilities( robotSerial ), settings ) );
+}
+
+void Neato::updateCapabilities( const QString &robotSerial, Capabilities capabilities )
+{
+  m_capabilities.insert( robotSerial, capabilities );
+  m_startCleaningBodies.insert( robotSerial, buildStartCleaningBody( capabilities, m_cleaningSettings.value( robotSerial ) ) );
+}
+
+const QByteArray &Neato::startCleaningBody( const QString &robotSerial )
+{
+  auto body = m_startCleaningBodies.find( robotSerial );
+  if ( body == m_startCleaningBodies.end() )
+    body = m_startCleaningBodies.insert( robotSerial, buildStartCleaningBody( capabilities( robotSerial ), m_cleaningSettings.value( robotSerial ) ) );
+  return *body;
+}
+
+bool Neato::supportsMaps( Capabilities capabilities, MapKind kind )
+{
+  if ( kind == MapKind::Persistent )
+    return capabilities.testFlag( Capability::PersistentMaps );
+  // assume cleaning maps until the robot reported its services
+  return !capabilities.testFlag( Capability::ServicesKnown ) || capabilities.testFlag( Capability::CleaningMaps );
+}
+
+void Neato::loadMaps( const QString &robotSerial, MapKind kind, const MapsHandler &handler )
+{
+  if ( !supportsMaps( capabilities( robotSerial ), kind ) ) {
+    qCDebug(dcNeato()) << "Robot" << robotSerial << "has no maps of kind" << static_cast<int>(kind);
+    handler( false, {} );
+    return;
+  }
+
+  const QString path = kind == MapKind::Persistent ? QStringLiteral("/users/me/robots/%1/persistent_maps").arg( robotSerial )
+                                                   : QStringLiteral("/users/me/robots/%1/maps").arg( robotSerial );
+
+  const RequestTag tag{ RequestMetrics::Endpoint::Maps, TraceBuffer::hashSerial( robotSerial ), robotSerial };
+  beehiveGet( tag, RequestScheduler::Priority::RobotList, path, [this, tag, robotSerial, kind, handler]( QNetworkReply *reply ) {
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status != 200 || reply->error() != QNetworkReply::NoError) {
+      qCWarning(dcNeato()) << "Loading maps of" << robotSerial << "failed:" << status << reply->errorString();
+      handler( false, {} );
+      return;
+    }
+
+    /*
+    persistent_maps gives us a list of floor plans:
+    [ { "id": "...", "name": "Ground floor", "url": "https://...png", "raw_floor_map_url": "...", "url_valid_for_seconds": 3600 } ]
+
+    maps gives us the maps of the last cleaning runs:
+    { "stats": { ... }, "maps": [ { "id": "...", "url": "https://...png", "url_valid_for_seconds": 3600, "start_at": "...", "end_at": "...", ... } ] }
+    */
+    m_decoder->run( lifetime( tag ), [body = reply->readAll(), kind]() { return NeatoReplies::decodeMaps( body, kind ); },
+                    [handler]( std::optional<QVector<MapInfo>> &&maps ) {
+      if ( !maps ) {
+        qCWarning(dcNeato()) << "Map list: Received invalid response";
+        handler( false, {} );
+        return;
+      }
+      handler( true, *maps );
+    });
+  });
+}
+
+Neato::RobotListDiff Neato::diffRobots( const QVector<Robot> &previous, const QVector<Robot> &current )
+{
+  RobotListDiff diff;
+  diff.initial = previous.isEmpty();
+
+  QHash<QString, const Robot *> known;
+  known.reserve( previous.size() );
+  for ( const auto &r : previous )
+    known.insert( r.serial, &r );
+
+  for ( const auto &r : current ) {
+    const Robot *old = known.take( r.serial );
+    if ( !old ) {
+      diff.added.append( r );
+      continue;
+    }
+    if ( old->name != r.name )
+      diff.renamed.append( r );
+    if ( old->secret_key != r.secret_key )
+      diff.secretRotated.append( r );
+  }
+
+  for ( auto it = known.cbegin(); it != known.cend(); ++it )
+    diff.vanished.append( it.key() );
+  return diff;
+}
+
+void Neato::updateNucleoContexts( const RobotListDiff &diff )
+{
+  // only new robots and rotated secrets need new key material
+  for ( const auto &serial : diff.vanished ) {
+    cancelRobotRequests( serial );
+    m_nucleoContexts.remove( serial );
+    m_stateSequences.remove( serial );
+    m_robotBuckets.remove( serial );
+    m_capabilities.remove( serial );
+    m_cleaningSettings.remove( serial );
+    m_startCleaningBodies.remove( serial );
+  }
+  for ( const auto &r : diff.added )
+    m_nucleoContexts.insert( r.serial, makeNucleoContext( r ) );
+  for ( const auto &r : diff.secretRotated )
+    m_nucleoContexts.insert( r.serial, makeNucleoContext( r ) );
+
+  // traits are cheap to re-read, the services reported by the robots are kept
+  for ( const auto &r : qAsConst(m_robots) ) {
+    const Capabilities caps = capabilities( r.serial );
+    const Capabilities updated = ( caps & ~traitCapabilities ) | capabilitiesFromTraits( r.traits );
+    if ( updated != caps || !m_capabilities.contains( r.serial ) )
+      updateCapabilities( r.serial, updated );
+  }
+}
+
+Neato::NucleoContext Neato::makeNucleoContext( const Robot &robot ) const
+{
+  NucleoContext ctx;
+  ctx.secretKey  = robot.secret_key.toLatin1();
+  ctx.innerPad   = hmacPad( ctx.secretKey, 0x36 );
+  ctx.outerPad   = hmacPad( ctx.secretKey, 0x5c );
+  ctx.signPrefix = robot.serial.toLower().toLatin1() + '\n';
+  ctx.serial     = robot.serial;
+  ctx.serialHash = TraceBuffer::hashSerial( robot.serial );
+
+  ctx.request.setUrl( nucleoRequestUrl( QStringLiteral("/vendors/neato/robots/%1/messages").arg( robot.serial ) ) );
+  ctx.request.setHeader   (QNetworkRequest::KnownHeaders::ContentTypeHeader, "application/json");
+  ctx.request.setRawHeader("Accept", "application/vnd.neato.nucleo.v1");
+  return ctx;
+}
+
+void Neato::sendNucleoMessage( const NucleoContext &ctx, const QByteArray &body, RequestScheduler::Priority priority, const ReplyHandler &handler )
+{
+  // see https://developers.neatorobotics.com/api/nucleo, the signature covers
+  // "<lowercase serial>\n<date>\n<body>" keyed with the robot secret
+  const QByteArray &date = nucleoDate();
+
+  QCryptographicHash inner( QCryptographicHash::Sha256 );
+  inner.addData( ctx.innerPad );
+  inner.addData( ctx.signPrefix );
+  inner.addData( date );
+  inner.addData( QByteArrayLiteral("\n") );
+  inner.addData( body );
+
+  QCryptographicHash outer( QCryptographicHash::Sha256 );
+  outer.addData( ctx.outerPad );
+  outer.addData( inner.result() );
+
+  QByteArray authorization;
+  authorization.reserve( 9 + 64 );
+  authorization.append( "NEATOAPP " );
+  authorization.append( outer.result().toHex() );
+
+  QNetworkRequest request( ctx.request );
+  request.setRawHeader( "Date", date );
+  request.setRawHeader( "Authorization", authorization );
+  submit( { RequestMetrics::Endpoint::RobotMessages, ctx.serialHash, ctx.serial }, priority, QByteArrayLiteral("POST"), request, body, handler );
+}
+
+const QByteArray &Neato::nucleoDate()
+{
+  // Nucleo rejects signatures with a date too far off its own clock, so a drifting
+  // local clock is corrected by the offset seen on Nucleo replies, or Beehive ones before
+  auto offset = m_scheduler->clockOffset( RequestScheduler::hostKey( m_endpoints.nucleo ) );
+  if ( !offset )
+    offset = m_scheduler->clockOffset( RequestScheduler::hostKey( m_endpoints.beehive ) );
+  const qint64 now = QDateTime::currentMSecsSinceEpoch() + offset.value_or( 0 );
+
+  // the header has a resolution of one second, format it only once per second
+  const qint64 second = now / 1000;
+  if ( second != m_nucleoDateSecond ) {
+    m_nucleoDateSecond = second;
+    m_nucleoDate = QLocale::c().toString( QDateTime::fromSecsSinceEpoch( second, Qt::UTC ), QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'") ).toLatin1();
+  }
+  return m_nucleoDate;
+}
+
 void Neato::setState(State newState)
 {
   if ( m_state != newState ) {
@@ -294,20 +1026,10 @@ void Neato::setState(State newState)
 
 QUrl Neato::beehiveRequestUrl(const QString &path) const
 {
-  static QByteArray baseBeehiveUrl = QByteArrayLiteral("https://beehive.neatocloud.com");
-  QUrl url( baseBeehiveUrl );
-  if ( path.length() )
-    url.setPath(path);
-
-  return url;
+  return appendPath( m_endpoints.beehive, path );
 }
 
 QUrl Neato::nucleoRequestUrl(const QString &path) const
 {
-  static QByteArray baseNucleoUrl  = QByteArrayLiteral("https://nucleo.neatocloud.com:4443");
-  QUrl url( baseNucleoUrl );
-  if ( path.length() )
-    url.setPath(path);
-
-  return url;
+  return appendPath( m_endpoints.nucleo, path );
 }
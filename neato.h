@@ -22,15 +22,26 @@
 #define NEATO_H
 
 
-#include <network/networkaccessmanager.h>
+#include "requestscheduler.h"
+#include "requestmetrics.h"
+#include "tracebuffer.h"
+#include "tokenbucket.h"
+#include "replydecoder.h"
+#include "jsondecode.h"
+
 #include <integrations/thing.h>
 
 #include <QObject>
 #include <QDateTime>
 #include <QVector>
+#include <QHash>
+#include <QStringList>
+#include <QNetworkRequest>
+#include <QPointer>
+#include <QUrl>
 #include <optional>
+#include <functional>
 
-class QTimer;
 class QNetworkReply;
 
 class Neato : public QObject
@@ -60,6 +71,19 @@ public:
     QVector<QString> traits;
   };
 
+  /*!
+  Changes between two robot lists, keyed by robot serial
+  */
+  struct RobotListDiff {
+    QVector<Robot> added;
+    QVector<Robot> renamed;
+    QVector<Robot> secretRotated;
+    QStringList vanished;
+    bool initial = false; // there was no previous list to compare with
+
+    bool isEmpty() const { return added.isEmpty() && renamed.isEmpty() && secretRotated.isEmpty() && vanished.isEmpty(); }
+  };
+
   // codes as defined in https://developers.neatorobotics.com/api/robot-remote-protocol/request-response-formats
   enum class StateCode {
     Invalid,
@@ -122,7 +146,7 @@ public:
     QString alert; // Specifies the current alert state in the robot. Alerts are defined as a non-blocking condition that does not require user intervention. Alerts can be cleared on the apps, issuing the appropriate call dimissCurrentAlert.
 
     // Provides additional information on the current or last cleaning settings. These params SHOULD be used by the apps to set the defaults cleaning settings.
-    struct {
+    struct Cleaning {
       CleaningCategory category = CleaningCategory::Invalid;
       CleaningPerformance mode  = CleaningPerformance::Invalid;
       CleaningModifier modifier = CleaningModifier::Invalid;
@@ -131,7 +155,7 @@ public:
       std::optional<int> spotHeight;
     } cleaning;
 
-    struct {
+    struct Details {
       bool isCharging = false;
       bool isDocked   = false;
       bool dockHasBeenSeen = false;
@@ -140,7 +164,7 @@ public:
     } details;
 
     // The commands that a Robot will accept.
-    struct {
+    struct AvailableCommands {
       bool start = false;
       bool stop  = false;
       bool pause = false;
@@ -150,9 +174,92 @@ public:
 
   };
 
-  explicit Neato( NetworkAccessManager &nwAccess, const QByteArray &clientId, const QByteArray &clientSecret, QObject *parent = nullptr );
+  enum class MapKind {
+    Persistent, // floor plans used for no-go lines and zones
+    Cleaning    // maps recorded during past cleaning runs
+  };
+
+  /*!
+  Map info as returned by the Beehive maps and persistent_maps endpoints
+  */
+  struct MapInfo {
+    QString id;
+    QString name;         // persistent maps only
+    QUrl url;             // signed image url, only valid until validUntil
+    QDateTime validUntil;
+    QDateTime startAt;    // cleaning maps only
+  };
+
+  using MapsHandler = std::function<void( bool ok, const QVector<MapInfo> &maps )>;
+
+  /*!
+  What a robot supports, from its Beehive traits and the services it reports to Nucleo.
+  The startCleaning parameters follow from it: basic-1 takes the modes only, basic-2 and
+  newer take modes and navigation mode, minimal-2 and newer the navigation mode only.
+  */
+  enum class Capability : quint8 {
+    HouseCleaningModes = 0x01, // startCleaning takes mode and modifier, i.e. eco or turbo
+    NavigationModes    = 0x02, // startCleaning takes a navigationMode, i.e. extra care
+    PersistentMaps     = 0x04, // floor plans, needed for no-go lines
+    CleaningMaps       = 0x08, // maps of past cleaning runs
+    ServicesKnown      = 0x80  // availableServices was reported, before that only the traits are known
+  };
+  Q_DECLARE_FLAGS(Capabilities, Capability)
+
+  // the robot settings that go into startCleaning
+  struct CleaningSettings {
+    bool eco = true;        // eco instead of turbo mode
+    bool care = false;      // extra care navigation
+    bool noGoLines = true;  // clean along the floor plan, honoring its no-go lines
+  };
+
+  // Nucleo commands the plugin sends to a robot
+  enum class RobotCommand {
+    StartCleaning,
+    PauseCleaning,
+    ResumeCleaning,
+    StopCleaning,
+    SendToBase
+  };
+
+  // accepted is true if nucleo relayed the command and the robot answered with "ok"
+  using CommandHandler = std::function<void( bool accepted, int httpStatus )>;
+
+  /*!
+  Base urls of the Neato cloud services. Paths are appended to them, so a local
+  stand-in may also be mounted below a path prefix.
+  */
+  struct Endpoints {
+    QUrl authorize = QUrl( QStringLiteral("https://apps.neatorobotics.com/oauth2/authorize") );
+    QUrl beehive   = QUrl( QStringLiteral("https://beehive.neatocloud.com") );
+    QUrl nucleo    = QUrl( QStringLiteral("https://nucleo.neatocloud.com:4443") );
+
+    // the defaults, each overridable by NEATO_AUTHORIZE_URL, NEATO_BEEHIVE_URL and NEATO_NUCLEO_URL
+    static Endpoints fromEnvironment();
+
+    // concurrent requests the scheduler allows to each of the two services
+    void applyHostLimits( RequestScheduler &scheduler ) const;
+  };
+
+  // large replies are decoded on the decoder's workers, both are shared by all accounts
+  explicit Neato( RequestScheduler &scheduler, ReplyDecoder &decoder, const Endpoints &endpoints, const QByteArray &clientId, const QByteArray &clientSecret, QObject *parent = nullptr );
   ~Neato();
 
+  // number of live instances, to spot accounts that are never cleaned up
+  static int instanceCount();
+
+  RequestMetrics &metrics();
+
+  // request budget per minute, Neato rate limits each account and each robot
+  struct RateLimits {
+    int accountPerMinute = 60;
+    int robotPerMinute = 10;
+  };
+  void setRateLimits( const RateLimits &limits );
+
+  // the recent requests of this account, oldest first
+  QStringList dumpTrace() const;
+
   QUrl loginUrl() const;
 
   void fetchAcessTokenFromAuthorizationCode(const QString &authorizationCode);
@@ -164,32 +271,119 @@ public:
   void loadRobots();
   const QVector<Robot> &robots() const;
 
+  // seeds the robot list from a persisted snapshot, loadRobots() only transfers it again if the ETag changed
+  void restoreRobots( const QVector<Robot> &robots, const QByteArray &etag );
+  QByteArray robotsETag() const;
+
   void pollRobotState( const QString &robotSerial );
+  void sendRobotCommand( const QString &robotSerial, RobotCommand command, const CommandHandler &handler );
+
+  // fails right away for map kinds the robot does not support
+  void loadMaps( const QString &robotSerial, MapKind kind, const MapsHandler &handler );
+
+  // aborts the requests of one robot, e.g. once its thing is removed
+  void cancelRobotRequests( const QString &robotSerial );
+  // aborts everything of the account, no handler runs afterwards and no request is sent anymore
+  void cancel();
+
+  Capabilities capabilities( const QString &robotSerial ) const;
+  void setCleaningSettings( const QString &robotSerial, const CleaningSettings &settings );
+  static bool supportsMaps( Capabilities capabilities, MapKind kind );
 
 private slots:
   void handleTokenReply( QNetworkReply *reply );
 
 private:
+  /*!
+  Everything needed to sign and send a Nucleo message for one robot.
+  Built once per robot secret, so a poll only has to hash the date and body.
+  */
+  struct NucleoContext {
+    QByteArray secretKey;   // the secret the pads were derived from, used to detect rotation
+    QByteArray innerPad;    // HMAC-SHA256 key XOR ipad
+    QByteArray outerPad;    // HMAC-SHA256 key XOR opad
+    QByteArray signPrefix;  // "<lowercase serial>\n", first line of the string to sign
+    QNetworkRequest request; // prebuilt request, only Date and Authorization change per message
+    QString serial;          // scopes the robot's requests for cancellation
+    quint32 serialHash = 0;  // identifies the robot in the trace
+  };
+
+  // what a request is accounted and traced as
+  struct RequestTag {
+    RequestMetrics::Endpoint endpoint;
+    quint32 serialHash = 0;
+    QString robotSerial;   // empty for account wide requests
+  };
+
+  // a request waiting for the token refresh, tagged so a removed robot's requests can be dropped
+  struct ParkedRequest {
+    QString robotSerial;
+    std::function<void()> replay;
+  };
+
+  // state polls of one robot, numbered when sent so a reply decoded late can not overwrite a newer state
+  struct StateSequence {
+    quint32 sent = 0;
+    quint32 applied = 0;
+  };
+
+  using ReplyHandler = std::function<void( QNetworkReply *reply )>;
+
   void setState( State newState );
+  void sendTokenRequest( const QNetworkRequest &request, const QByteArray &body );
+  void recordRequest( const RequestTag &tag, quint32 requestId, qint64 startedAt, QNetworkReply *reply );
+  // a 429 drains the budget it was answered for instead of pausing the whole host
+  void quotaExceeded( const RequestTag &tag, QNetworkReply *reply );
+  QObject *lifetime( const RequestTag &tag );
+  void submit( const RequestTag &tag, RequestScheduler::Priority priority, const QByteArray &verb, const QNetworkRequest &request, const QByteArray &body, const ReplyHandler &handler );
+  void beehiveGet( const RequestTag &tag, RequestScheduler::Priority priority, const QString &path, const ReplyHandler &handler, const QByteArray &etag = QByteArray(), bool isReplay = false );
+  void replayParkedRequests( bool tokenValid );
   QUrl beehiveRequestUrl ( const QString &path = QString() ) const;
   QUrl nucleoRequestUrl  ( const QString &path = QString() ) const;
 
+  static RobotListDiff diffRobots( const QVector<Robot> &previous, const QVector<Robot> &current );
+  void updateNucleoContexts( const RobotListDiff &diff );
+  void updateCapabilities( const QString &robotSerial, Capabilities capabilities );
+  const QByteArray &startCleaningBody( const QString &robotSerial );
+  NucleoContext makeNucleoContext( const Robot &robot ) const;
+  TokenBucket &robotBucket( const QString &robotSerial );
+  void sendNucleoMessage( const NucleoContext &ctx, const QByteArray &body, RequestScheduler::Priority priority, const ReplyHandler &handler );
+  const QByteArray &nucleoDate();
+
 signals:
   void stateChanged ( State state );
 
   // signal only emitted once we managed to get a valid access token, either via accessCode or refreshToken
   void authenticated( bool authenticated );
 
-  void robotsLoaded();
+  void robotsLoaded( const Neato::RobotListDiff &diff );
+  // every answer to loadRobots, ok if the list was taken over or did not change
+  void robotsLoadFinished( bool ok );
 
+  void robotStateReceived( const QString &robotSerial, const Neato::RobotState &state );
+  void robotStateFailed( const QString &robotSerial, int httpStatus );
+
+  // the poll was not sent to keep budget for commands, retry in the given time
+  void robotStatePollShed( const QString &robotSerial, qint64 retryInMs );
 
   void connectionChanged( bool connected );
   void authenticationStatusChanged( bool authenticated );
 
 private:
   State m_state = State::Disconnected;
-  NetworkAccessManager *m_networkManager = nullptr;
-  QTimer *m_tokenTimeout = nullptr;
+  RequestScheduler *m_scheduler = nullptr;
+  ReplyDecoder *m_decoder = nullptr;
+  Endpoints m_endpoints;
+  RequestMetrics m_metrics;
+  TraceBuffer m_trace;
+  quint32 m_nextRequestId = 0;
+  // cancellation tokens, requests die with them: one for the account, one per robot below it
+  QPointer<QObject> m_lifetime;
+  QHash<QString, QObject *> m_robotLifetimes; // by serial
+  ClockTimer *m_tokenTimeout = nullptr;
+  ClockTimer *m_tokenRetry = nullptr;
+  ClockTimer *m_robotsRetry = nullptr;
+  qint64 m_tokenExpiresAt = 0; // on the scheduler's clock, 0 while no token expiry is known
 
   // OAuth information:
   QByteArray m_clientId;
@@ -198,8 +392,43 @@ private:
   QString m_refreshToken;
   QByteArray m_redirectUri;
 
+  // single flight token handling, requests issued meanwhile are parked until it finishes
+  bool m_tokenPending = false;
+  bool m_tokenIsRefresh = false;   // only refresh grants are retried, authorization codes are single use
+  Backoff m_tokenBackoff{ std::chrono::seconds(5), std::chrono::minutes(10) };
+  quint32 m_tokenGeneration = 0;
+  QPointer<QNetworkReply> m_tokenReply;
+  QVector<ParkedRequest> m_parkedRequests;
+
   // neato data
   QVector<Robot> m_robots;
+  QByteArray m_robotsETag;
+  quint32 m_robotsGeneration = 0; // robot lists decoded after a newer one are dropped
+  Backoff m_robotsBackoff{ std::chrono::seconds(10), std::chrono::minutes(15) };
+  QHash<QString, NucleoContext> m_nucleoContexts;
+  QHash<QString, StateSequence> m_stateSequences;
+  qint64 m_nucleoDateSecond = -1; // second the cached Date header was formatted for
+  QByteArray m_nucleoDate;
+  QHash<QString, Capabilities> m_capabilities;
+  QHash<QString, CleaningSettings> m_cleaningSettings;
+  QHash<QString, QByteArray> m_startCleaningBodies; // serialized startCleaning per robot, rebuilt on settings or capability changes
+
+  // rate limiting
+  RateLimits m_rateLimits;
+  TokenBucket m_accountBucket;
+  QHash<QString, TokenBucket> m_robotBuckets;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(Neato::Capabilities)
+
+// valid codes of the enums above, for replies as well as for cached states
+namespace JsonDecode {
+  template<> struct EnumRange<Neato::StateCode>           { static constexpr auto last = Neato::StateCode::Error; };
+  template<> struct EnumRange<Neato::ActionCode>          { static constexpr auto last = Neato::ActionCode::SuspendedExploration; };
+  template<> struct EnumRange<Neato::CleaningCategory>    { static constexpr auto last = Neato::CleaningCategory::Map; };
+  template<> struct EnumRange<Neato::CleaningPerformance> { static constexpr auto last = Neato::CleaningPerformance::Turbo; };
+  template<> struct EnumRange<Neato::CleaningModifier>    { static constexpr auto last = Neato::CleaningModifier::Double; };
+  template<> struct EnumRange<Neato::NavigationMode>      { static constexpr auto last = Neato::NavigationMode::Deep; };
+}
+
 #endif // NEATO_H
@@ -3,8 +3,39 @@ include($$[QT_INSTALL_PREFIX]/include/nymea/plugin.pri)
 CONFIG += c++17
 QT += network
 
+# benchmarks and the soak test are a separate project, see tests/tests.pro and the README
+
 SOURCES += integrationpluginneato.cpp \
-           neato.cpp
+           neato.cpp \
+           pollscheduler.cpp \
+           robotcache.cpp \
+           commandqueue.cpp \
+           mapcache.cpp \
+           robotregistry.cpp \
+           requestscheduler.cpp \
+           requestmetrics.cpp \
+           tracebuffer.cpp \
+           backoff.cpp \
+           tokenbucket.cpp \
+           bringupqueue.cpp \
+           replydecoder.cpp \
+           neatoreplies.cpp \
+           clock.cpp
 
 HEADERS += integrationpluginneato.h \
-           neato.h 
+           neato.h \
+           pollscheduler.h \
+           robotcache.h \
+           commandqueue.h \
+           mapcache.h \
+           robotregistry.h \
+           requestscheduler.h \
+           requestmetrics.h \
+           tracebuffer.h \
+           backoff.h \
+           tokenbucket.h \
+           bringupqueue.h \
+           replydecoder.h \
+           neatoreplies.h \
+           clock.h \
+           jsondecode.h
@@ -0,0 +1,170 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "neatoreplies.h"
+#include "extern-plugininfo.h"
+#include "jsondecode.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDateTime>
+
+namespace JsonDecode {
+  template<> struct Schema<NeatoReplies::ServiceVersions> {
+    using V = NeatoReplies::ServiceVersions;
+    static constexpr auto fields = std::make_tuple(
+      field( "houseCleaning", &V::houseCleaning ),
+      field( "maps",          &V::maps )
+    );
+  };
+
+  template<> struct Schema<Neato::Robot> {
+    using R = Neato::Robot;
+    static constexpr auto fields = std::make_tuple(
+      field( "serial",       &R::serial,       true ),
+      field( "prefix",       &R::prefix,       true ),
+      field( "name",         &R::name,         true ),
+      field( "model",        &R::model,        true ),
+      field( "secret_key",   &R::secret_key,   true ),
+      field( "purchased_at", &R::purchased_at ),
+      field( "linked_at",    &R::linked_at ),
+      field( "traits",       &R::traits )
+    );
+  };
+
+  template<> struct Schema<Neato::RobotState::Cleaning> {
+    using C = Neato::RobotState::Cleaning;
+    static constexpr auto fields = std::make_tuple(
+      field( "category",       &C::category ),
+      field( "mode",           &C::mode ),
+      field( "modifier",       &C::modifier ),
+      field( "navigationMode", &C::navigationMode ),
+      field( "spotWidth",      &C::spotWidth ),
+      field( "spotHeight",     &C::spotHeight )
+    );
+  };
+
+  template<> struct Schema<Neato::RobotState::Details> {
+    using D = Neato::RobotState::Details;
+    static constexpr auto fields = std::make_tuple(
+      field( "isCharging",        &D::isCharging ),
+      field( "isDocked",          &D::isDocked ),
+      field( "dockHasBeenSeen",   &D::dockHasBeenSeen ),
+      field( "charge",            &D::charge ),
+      field( "isScheduleEnabled", &D::isScheduleEnabled )
+    );
+  };
+
+  template<> struct Schema<Neato::RobotState::AvailableCommands> {
+    using A = Neato::RobotState::AvailableCommands;
+    static constexpr auto fields = std::make_tuple(
+      field( "start",    &A::start ),
+      field( "stop",     &A::stop ),
+      field( "pause",    &A::pause ),
+      field( "resume",   &A::resume ),
+      field( "goToBase", &A::goToBase )
+    );
+  };
+
+  template<> struct Schema<Neato::RobotState> {
+    using S = Neato::RobotState;
+    static constexpr auto fields = std::make_tuple(
+      field( "state",             &S::state,  true ),
+      field( "action",            &S::action, true ),
+      field( "error",             &S::error ),
+      field( "alert",             &S::alert ),
+      field( "cleaning",          &S::cleaning ),
+      field( "details",           &S::details ),
+      field( "availableCommands", &S::availableCommands )
+    );
+  };
+
+  template<> struct Schema<Neato::MapInfo> {
+    using M = Neato::MapInfo;
+    static constexpr auto fields = std::make_tuple(
+      field( "id",       &M::id,  true ),
+      field( "url",      &M::url, true ),
+      field( "name",     &M::name ),     // persistent maps only
+      field( "start_at", &M::startAt )   // cleaning maps only
+    );
+  };
+}
+
+namespace NeatoReplies {
+  std::optional<QVector<Neato::Robot>> decodeRobots( const QByteArray &body )
+  {
+    QJsonParseError error;
+    const QJsonDocument data = QJsonDocument::fromJson( body, &error );
+    if ( error.error != QJsonParseError::NoError )
+      return std::nullopt;
+
+    const QJsonArray list = data.array();
+    QVector<Neato::Robot> robots;
+    robots.reserve( list.size() );
+    for ( const QJsonValue &elem : list ) {
+      Neato::Robot r;
+      if ( !JsonDecode::decodeValue( elem, r ) ) {
+        qCDebug(dcNeato()) << "Robot list: Ignoring invalid robot element";
+        continue;
+      }
+      robots.append( std::move(r) );
+    }
+    return robots;
+  }
+
+  StateReply decodeStateReply( const QByteArray &body )
+  {
+    StateReply reply;
+    QJsonParseError error;
+    const QJsonObject data = QJsonDocument::fromJson( body, &error ).object();
+    if ( error.error != QJsonParseError::NoError || !JsonDecode::decode( data, reply.state ) )
+      return reply;
+
+    reply.valid = true;
+    ServiceVersions services;
+    if ( JsonDecode::decodeValue( data.value(QLatin1String("availableServices")), services ) )
+      reply.services = std::move(services);
+    return reply;
+  }
+
+  std::optional<QVector<Neato::MapInfo>> decodeMaps( const QByteArray &body, Neato::MapKind kind )
+  {
+    QJsonParseError error;
+    const QJsonDocument data = QJsonDocument::fromJson( body, &error );
+    if ( error.error != QJsonParseError::NoError )
+      return std::nullopt;
+
+    const QJsonArray list = kind == Neato::MapKind::Persistent ? data.array() : data.object().value("maps").toArray();
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+
+    QVector<Neato::MapInfo> maps;
+    maps.reserve( list.size() );
+    for ( const auto &elem : list ) {
+      const QJsonObject &o = elem.toObject();
+      Neato::MapInfo m;
+      if ( !JsonDecode::decode( o, m ) )
+        continue;
+      m.validUntil = now.addSecs( o.value("url_valid_for_seconds").toInt() );
+      maps.append( std::move(m) );
+    }
+    return maps;
+  }
+}
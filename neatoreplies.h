@@ -0,0 +1,55 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef NEATOREPLIES_H
+#define NEATOREPLIES_H
+
+#include "neato.h"
+
+#include <QByteArray>
+#include <QVector>
+#include <optional>
+
+/*!
+  Decoding of the Beehive and Nucleo reply bodies.
+
+  These run on the ReplyDecoder workers, so nothing in here may touch a Neato
+  instance. Kept apart from Neato so the decoding cost can be measured alone.
+*/
+namespace NeatoReplies {
+  // availableServices of a robot state, values are versions like "basic-3"
+  struct ServiceVersions {
+    QString houseCleaning;
+    QString maps;
+  };
+
+  struct StateReply {
+    bool valid = false;
+    Neato::RobotState state;
+    std::optional<ServiceVersions> services;
+  };
+
+  // invalid robot elements are skipped, nullopt if the body is no JSON
+  std::optional<QVector<Neato::Robot>> decodeRobots( const QByteArray &body );
+  StateReply decodeStateReply( const QByteArray &body );
+  std::optional<QVector<Neato::MapInfo>> decodeMaps( const QByteArray &body, Neato::MapKind kind );
+}
+
+#endif // NEATOREPLIES_H
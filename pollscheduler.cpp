@@ -0,0 +1,204 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "pollscheduler.h"
+#include "extern-plugininfo.h"
+
+#include <QRandomGenerator>
+#include <QStringList>
+#include <algorithm>
+
+using namespace std::chrono_literals;
+
+namespace {
+  constexpr std::chrono::milliseconds cleaningInterval = 10s;
+  constexpr std::chrono::milliseconds attentionInterval = 30s;   // paused, error or unknown state
+  constexpr std::chrono::milliseconds defaultInterval = 60s;
+  constexpr std::chrono::milliseconds idleDockedInterval = 5min; // docked and fully charged
+
+  // failed polls double the attention interval this often at most, idleDockedInterval caps it earlier
+  constexpr int maxRetryDoublings = 4;
+
+  // polls closer together than this are fired in one go
+  constexpr qint64 coalesceWindowMs = 20;
+
+  // std heap functions build a max heap, invert the order to get the earliest deadline on top
+  constexpr auto laterDeadline = []( const auto &a, const auto &b ) { return a.deadline > b.deadline; };
+}
+
+PollScheduler::PollScheduler( Clock &clock, QObject *parent )
+  : QObject{parent}
+  , m_clock( &clock )
+  , m_timer( new ClockTimer(clock, this) )
+{
+  m_timer->setSingleShot(true);
+  m_timer->setTimerType(Qt::CoarseTimer);
+  connect( m_timer, &ClockTimer::timeout, this, &PollScheduler::fire );
+}
+
+void PollScheduler::add( const QString &robotSerial )
+{
+  if ( contains( robotSerial ) )
+    return;
+
+  const qint64 spread = QRandomGenerator::global()->bounded( static_cast<qint64>(defaultInterval.count()) );
+  push( robotSerial, m_clock->now() + spread );
+}
+
+void PollScheduler::remove( const QString &robotSerial )
+{
+  // heap entries of removed robots are dropped once they reach the top
+  m_generations.remove( robotSerial );
+  m_failures.remove( robotSerial );
+}
+
+bool PollScheduler::contains( const QString &robotSerial ) const
+{
+  return m_generations.contains( robotSerial );
+}
+
+void PollScheduler::schedule( const QString &robotSerial, const Neato::RobotState &state )
+{
+  m_failures.remove( robotSerial );
+  scheduleIn( robotSerial, withJitter( intervalFor( state ) ) );
+}
+
+void PollScheduler::scheduleRetry( const QString &robotSerial )
+{
+  // a busy robot that stopped answering must not be hammered at the cleaning interval
+  const int doublings = std::min( m_failures[ robotSerial ]++, maxRetryDoublings );
+  const std::chrono::milliseconds delay = std::min<std::chrono::milliseconds>( attentionInterval * ( 1 << doublings ), idleDockedInterval );
+  scheduleIn( robotSerial, withJitter( delay ) );
+}
+
+void PollScheduler::scheduleIn( const QString &robotSerial, std::chrono::milliseconds delay )
+{
+  push( robotSerial, m_clock->now() + delay.count() );
+}
+
+std::chrono::milliseconds PollScheduler::intervalFor( const Neato::RobotState &state )
+{
+  switch ( state.state ) {
+    case Neato::StateCode::Busy:
+      return cleaningInterval;
+    case Neato::StateCode::Paused:
+    case Neato::StateCode::Error:
+    case Neato::StateCode::Invalid:
+      return attentionInterval;
+    case Neato::StateCode::Idle:
+      break;
+  }
+
+  if ( state.details.isDocked && !state.details.isCharging )
+    return idleDockedInterval;
+  return defaultInterval;
+}
+
+void PollScheduler::setPaused( bool paused )
+{
+  if ( m_paused == paused )
+    return;
+
+  m_paused = paused;
+  if ( m_paused ) {
+    m_timer->stop();
+    return;
+  }
+
+  // deadlines missed during the pause would all fire at once, later ones like reconcile polls are kept
+  std::vector<Entry> live;
+  live.reserve( m_generations.size() );
+  for ( const Entry &e : m_heap ) {
+    if ( m_generations.value( e.serial ) == e.generation )
+      live.push_back( e );
+  }
+  m_heap.clear();
+
+  const qint64 now = m_clock->now();
+  for ( const Entry &e : live ) {
+    qint64 deadline = e.deadline;
+    if ( deadline <= now )
+      deadline = now + QRandomGenerator::global()->bounded( static_cast<qint64>(defaultInterval.count()) );
+    push( e.serial, deadline );
+  }
+  rearm();
+}
+
+bool PollScheduler::isPaused() const
+{
+  return m_paused;
+}
+
+void PollScheduler::push( const QString &robotSerial, qint64 deadline )
+{
+  const quint64 generation = ++m_nextGeneration;
+  m_generations.insert( robotSerial, generation );
+  m_heap.push_back( Entry{ deadline, generation, robotSerial } );
+  std::push_heap( m_heap.begin(), m_heap.end(), laterDeadline );
+  rearm();
+}
+
+void PollScheduler::rearm()
+{
+  // drop stale entries so the timer is armed for a live deadline
+  while ( !m_heap.empty() && m_generations.value( m_heap.front().serial ) != m_heap.front().generation ) {
+    std::pop_heap( m_heap.begin(), m_heap.end(), laterDeadline );
+    m_heap.pop_back();
+  }
+
+  if ( m_heap.empty() || m_paused ) {
+    m_timer->stop();
+    return;
+  }
+
+  const qint64 remaining = std::max<qint64>( 0, m_heap.front().deadline - m_clock->now() );
+  if ( !m_timer->isActive() || m_timer->remainingTime() > remaining )
+    m_timer->start( std::chrono::milliseconds(remaining) );
+}
+
+void PollScheduler::fire()
+{
+  const qint64 now = m_clock->now() + coalesceWindowMs;
+  QStringList due;
+  while ( !m_heap.empty() && m_heap.front().deadline <= now ) {
+    std::pop_heap( m_heap.begin(), m_heap.end(), laterDeadline );
+    Entry e = std::move( m_heap.back() );
+    m_heap.pop_back();
+    if ( m_generations.value( e.serial ) != e.generation )
+      continue;
+    due.append( e.serial );
+  }
+
+  for ( const QString &serial : qAsConst(due) ) {
+    // fallback in case the poll never reports back, a result reschedules the robot
+    push( serial, m_clock->now() + idleDockedInterval.count() );
+    emit pollDue( serial );
+  }
+  rearm();
+}
+
+std::chrono::milliseconds PollScheduler::withJitter( std::chrono::milliseconds interval )
+{
+  // +-10% so robots sharing an interval drift apart instead of firing together
+  const qint64 range = interval.count() / 5;
+  if ( range <= 0 )
+    return interval;
+  return interval + std::chrono::milliseconds( QRandomGenerator::global()->bounded( range ) - range / 2 );
+}
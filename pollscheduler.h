@@ -0,0 +1,86 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef POLLSCHEDULER_H
+#define POLLSCHEDULER_H
+
+#include "neato.h"
+#include "clock.h"
+
+#include <QObject>
+#include <QHash>
+#include <chrono>
+#include <vector>
+
+/*!
+  Central deadline heap driving the state polls of all robots of all accounts.
+
+  Instead of a timer per robot a single timer is armed for the earliest deadline.
+  The interval of a robot is derived from its last known state, so cleaning robots
+  are followed closely while idle robots on the dock are only checked rarely.
+*/
+class PollScheduler : public QObject
+{
+  Q_OBJECT
+public:
+  explicit PollScheduler( Clock &clock, QObject *parent = nullptr );
+
+  // registers a robot, the first poll is spread randomly over the default interval
+  void add( const QString &robotSerial );
+  void remove( const QString &robotSerial );
+  bool contains( const QString &robotSerial ) const;
+
+  // schedule the next poll based on the last state the robot reported
+  void schedule( const QString &robotSerial, const Neato::RobotState &state );
+  // after a failed poll, backs off from the attention interval until a state arrives again
+  void scheduleRetry( const QString &robotSerial );
+  void scheduleIn( const QString &robotSerial, std::chrono::milliseconds delay );
+
+  static std::chrono::milliseconds intervalFor( const Neato::RobotState &state );
+
+  // while paused no poll fires, resuming spreads the polls missed meanwhile over the default interval
+  void setPaused( bool paused );
+  bool isPaused() const;
+
+signals:
+  void pollDue( const QString &robotSerial );
+
+private:
+  struct Entry {
+    qint64 deadline;
+    quint64 generation;
+    QString serial;
+  };
+
+  void push( const QString &robotSerial, qint64 deadline );
+  void rearm();
+  void fire();
+  static std::chrono::milliseconds withJitter( std::chrono::milliseconds interval );
+
+  std::vector<Entry> m_heap;              // min heap ordered by deadline
+  QHash<QString, quint64> m_generations;  // live generation per robot, heap entries with an older one are stale
+  QHash<QString, int> m_failures;         // consecutive failed polls per robot
+  quint64 m_nextGeneration = 0;
+  Clock *m_clock = nullptr;
+  ClockTimer *m_timer = nullptr;
+  bool m_paused = false;
+};
+
+#endif // POLLSCHEDULER_H
@@ -0,0 +1,68 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef REPLYDECODER_H
+#define REPLYDECODER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QRunnable>
+#include <QThreadPool>
+#include <memory>
+#include <type_traits>
+
+/*!
+  Small worker pool decoding reply bodies off the main thread.
+
+  The nymea main thread also serves JSON-RPC and the rules of all other plugins,
+  so parsing a large robot list or a burst of state replies should not stall it.
+  The body is read on the main thread, decoded on a worker and the result is
+  handed back as a value through a queued call on the thread of this object.
+*/
+class ReplyDecoder : public QObject
+{
+  Q_OBJECT
+public:
+  explicit ReplyDecoder( int maxThreads = 2, QObject *parent = nullptr );
+  ~ReplyDecoder();
+
+  /*!
+  Runs decode() on a worker and done( result ) afterwards, unless context is gone by then.
+  decode must not touch anything but its own captures, it runs concurrently with the main thread.
+  */
+  template<typename Decode, typename Done>
+  void run( QObject *context, Decode decode, Done done )
+  {
+    using Result = std::invoke_result_t<const Decode &>;
+    QPointer<QObject> guard( context );
+    m_pool.start( QRunnable::create( [this, guard, decode, done]() {
+      auto result = std::make_shared<Result>( decode() );
+      QMetaObject::invokeMethod( this, [guard, done, result]() {
+        if ( guard )
+          done( std::move(*result) );
+      }, Qt::QueuedConnection );
+    }));
+  }
+
+private:
+  QThreadPool m_pool;
+};
+
+#endif // REPLYDECODER_H
@@ -0,0 +1,91 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "requestmetrics.h"
+
+#include <QMetaEnum>
+#include <QStringList>
+#include <algorithm>
+
+namespace {
+  bool isError( int httpStatus )
+  {
+    // 304 answers a conditional robot list request and is a success
+    return httpStatus == 0 || ( httpStatus >= 300 && httpStatus != 304 );
+  }
+}
+
+void RequestMetrics::record( Endpoint endpoint, int httpStatus, qint64 latencyMs )
+{
+  Counters &c = m_counters[ static_cast<int>(endpoint) ];
+  ++c.requests;
+  if ( isError( httpStatus ) ) {
+    ++c.errors;
+    ++c.errorsByStatus[ httpStatus ];
+  }
+
+  const auto bucket = std::lower_bound( bucketBounds.cbegin(), bucketBounds.cend(), latencyMs );
+  ++c.latency[ static_cast<std::size_t>( bucket - bucketBounds.cbegin() ) ];
+}
+
+void RequestMetrics::recordShed( Endpoint endpoint )
+{
+  ++m_counters[ static_cast<int>(endpoint) ].shed;
+}
+
+const RequestMetrics::Counters &RequestMetrics::counters( Endpoint endpoint ) const
+{
+  return m_counters[ static_cast<int>(endpoint) ];
+}
+
+QString RequestMetrics::summary() const
+{
+  const QMetaEnum names = QMetaEnum::fromType<Endpoint>();
+  QStringList parts;
+  for ( int i = 0; i < endpointCount; ++i ) {
+    const Counters &c = m_counters[ i ];
+    if ( c.requests == 0 && c.shed == 0 )
+      continue;
+
+    QStringList errors;
+    for ( auto it = c.errorsByStatus.cbegin(); it != c.errorsByStatus.cend(); ++it )
+      errors.append( QStringLiteral("%1x%2").arg( it.value() ).arg( it.key() ) );
+
+    QStringList buckets;
+    for ( std::size_t b = 0; b < c.latency.size(); ++b ) {
+      const QString bound = b < bucketBounds.size() ? QStringLiteral("<=%1").arg( bucketBounds[ b ] ) : QStringLiteral(">%1").arg( bucketBounds.back() );
+      buckets.append( QStringLiteral("%1:%2").arg( bound ).arg( c.latency[ b ] ) );
+    }
+
+    parts.append( QStringLiteral("%1 %2 requests, %3 shed, %4 errors [%5], ms {%6}")
+                  .arg( QString::fromLatin1( names.valueToKey( i ) ) )
+                  .arg( c.requests )
+                  .arg( c.shed )
+                  .arg( c.errors )
+                  .arg( errors.join( QLatin1Char(' ') ) )
+                  .arg( buckets.join( QLatin1Char(' ') ) ) );
+  }
+  return parts.isEmpty() ? QStringLiteral("no requests") : parts.join( QStringLiteral("; ") );
+}
+
+void RequestMetrics::reset()
+{
+  m_counters = {};
+}
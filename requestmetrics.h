@@ -0,0 +1,72 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef REQUESTMETRICS_H
+#define REQUESTMETRICS_H
+
+#include <QObject>
+#include <QMap>
+#include <QString>
+#include <array>
+
+/*!
+  Request counters and latency histograms of one Neato account, per endpoint.
+
+  Histograms use fixed buckets so recording a request never allocates. The
+  plugin logs a summary periodically and resets the counters afterwards, so
+  every summary covers one interval.
+*/
+class RequestMetrics
+{
+  Q_GADGET
+public:
+  enum class Endpoint {
+    Token,
+    Robots,
+    RobotMessages,
+    Maps
+  };
+  Q_ENUM(Endpoint)
+
+  // upper bounds in milliseconds, slower requests land in the last bucket
+  static constexpr std::array<qint64, 8> bucketBounds = { 100, 250, 500, 1000, 2500, 5000, 10000, 30000 };
+
+  struct Counters {
+    int requests = 0;
+    int shed = 0;     // not sent because the rate limit budget was used up
+    int errors = 0;
+    QMap<int, int> errorsByStatus;  // http status, 0 for network errors and timeouts
+    std::array<int, bucketBounds.size() + 1> latency{};
+  };
+
+  // status is the http status, 0 if the request did not get an answer
+  void record( Endpoint endpoint, int httpStatus, qint64 latencyMs );
+  void recordShed( Endpoint endpoint );
+
+  const Counters &counters( Endpoint endpoint ) const;
+  QString summary() const;
+  void reset();
+
+private:
+  static constexpr int endpointCount = static_cast<int>(Endpoint::Maps) + 1;
+  std::array<Counters, endpointCount> m_counters;
+};
+
+#endif // REQUESTMETRICS_H
@@ -0,0 +1,289 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "requestscheduler.h"
+#include "extern-plugininfo.h"
+
+#include <QNetworkReply>
+#include <QDateTime>
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+  // applies to hosts without an explicit limit, e.g. the storage serving map images
+  constexpr int defaultHostLimit = 2;
+
+  // abort transfers that stall for this long, so no reply stays unfinished forever
+  constexpr int transferTimeout = 30 * 1000;
+
+  // consecutive failures that open the breaker of a host
+  constexpr int failureThreshold = 3;
+  constexpr std::chrono::milliseconds breakerBaseDelay = std::chrono::seconds(5);
+  constexpr std::chrono::milliseconds breakerMaxDelay = std::chrono::minutes(5);
+
+  // upper bound for a Retry-After the server asks for
+  constexpr std::chrono::milliseconds maxRetryAfter = std::chrono::minutes(15);
+
+  // set on replies aborted by cancel()
+  constexpr char cancelledProperty[] = "neatoCancelled";
+
+  // clock offsets changing by more than this are logged
+  constexpr qint64 clockOffsetLogThreshold = 2000;
+}
+
+RequestScheduler::RequestScheduler( NetworkAccessManager &nwAccess, Clock &clock, QObject *parent )
+  : QObject{parent}
+  , m_networkManager( &nwAccess )
+  , m_clock( &clock )
+{
+}
+
+RequestScheduler::~RequestScheduler()
+{
+  qDeleteAll( m_hosts );
+}
+
+Clock &RequestScheduler::clock() const
+{
+  return *m_clock;
+}
+
+int RequestScheduler::liveReplies() const
+{
+  return m_liveReplies;
+}
+
+void RequestScheduler::setHostLimit( const QString &host, int maxConcurrent )
+{
+  m_limits.insert( host, std::max( 1, maxConcurrent ) );
+  Host *known = m_hosts.value( host );
+  if ( known ) {
+    known->limit = m_limits.value( host );
+    pump( host );
+  }
+}
+
+void RequestScheduler::get( Priority priority, const QNetworkRequest &request, QObject *context, const Started &started )
+{
+  submit( priority, Pending{ false, request, QByteArray(), context, started } );
+}
+
+void RequestScheduler::post( Priority priority, const QNetworkRequest &request, const QByteArray &body, QObject *context, const Started &started )
+{
+  submit( priority, Pending{ true, request, body, context, started } );
+}
+
+void RequestScheduler::submit( Priority priority, Pending &&pending )
+{
+  const QString key = hostKey( pending.request.url() );
+  Host *host = m_hosts.value( key );
+  if ( !host ) {
+    host = new Host;
+    host->limit = m_limits.value( key, defaultHostLimit );
+    host->backoff = Backoff( breakerBaseDelay, breakerMaxDelay );
+    // a coarse timer may fire a little early, which would leave the breaker open for good
+    host->reopenTimer = new ClockTimer( *m_clock, this );
+    host->reopenTimer->setSingleShot( true );
+    host->reopenTimer->setTimerType( Qt::PreciseTimer );
+    connect( host->reopenTimer, &ClockTimer::timeout, this, [this, key] {
+      pump( key );
+    });
+    m_hosts.insert( key, host );
+  }
+
+  // allow HTTP/2 so requests to a host can share one connection
+  pending.request.setAttribute( QNetworkRequest::Http2AllowedAttribute, true );
+  if ( pending.request.transferTimeout() == 0 )
+    pending.request.setTransferTimeout( transferTimeout );
+  host->queues[ static_cast<int>(priority) ].enqueue( std::move(pending) );
+  pump( key );
+}
+
+void RequestScheduler::pump( const QString &key )
+{
+  Host *host = m_hosts.value( key );
+  if ( !host )
+    return;
+
+  if ( host->breaker == Breaker::Open ) {
+    const qint64 remaining = host->openUntil - m_clock->now();
+    if ( remaining > 0 ) {
+      if ( !host->reopenTimer->isActive() )
+        host->reopenTimer->start( std::chrono::milliseconds( remaining ) );
+      return;
+    }
+    qCDebug(dcNeato()) << "Probing" << key << "after a pause";
+    host->breaker = Breaker::HalfOpen;
+    if ( std::all_of( host->queues.cbegin(), host->queues.cend(), []( const QQueue<Pending> &q ) { return q.isEmpty(); } ) ) {
+      emit hostProbeDue( key );
+      return;
+    }
+  }
+
+  // while half open only the probe is in flight
+  auto hasSlot = [host] {
+    switch ( host->breaker ) {
+      case Breaker::Closed:
+        return host->active < host->limit;
+      case Breaker::HalfOpen:
+        return host->active == 0;
+      case Breaker::Open:
+        break;
+    }
+    return false;
+  };
+
+  for ( auto &queue : host->queues ) {
+    while ( !queue.isEmpty() && hasSlot() ) {
+      Pending pending = queue.dequeue();
+      if ( !pending.context )
+        continue;
+
+      QNetworkReply *reply = pending.isPost ? m_networkManager->post( pending.request, pending.body )
+                                            : m_networkManager->get( pending.request );
+      ++host->active;
+      ++m_liveReplies;
+      connect( reply, &QObject::destroyed, this, [this] {
+        --m_liveReplies;
+      });
+      // connected before the caller sees the reply, so a synchronous abort still frees the slot
+      connect( reply, &QNetworkReply::finished, this, [this, host, key, reply] {
+        --host->active;
+        if ( !reply->property( cancelledProperty ).toBool() ) {
+          recordOutcome( key, *host, reply );
+          recordClock( key, *host, reply );
+        }
+        pump( key );
+      });
+      connect( pending.context, &QObject::destroyed, reply, [reply]( QObject *context ) {
+        reply->disconnect( context );
+        cancel( reply );
+      });
+      pending.started( reply );
+    }
+  }
+}
+
+QString RequestScheduler::hostKey( const QUrl &url )
+{
+  return url.port() > 0 ? url.host() + QLatin1Char(':') + QString::number( url.port() ) : url.host();
+}
+
+bool RequestScheduler::isAvailable( const QString &host ) const
+{
+  const Host *known = m_hosts.value( host );
+  return !known || known->breaker == Breaker::Closed;
+}
+
+std::optional<std::chrono::milliseconds> RequestScheduler::retryAfter( QNetworkReply *reply )
+{
+  const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if ( ( status != 429 && status != 503 ) || !reply->hasRawHeader( "Retry-After" ) )
+    return std::nullopt;
+
+  // either delay seconds or an http date
+  const QByteArray value = reply->rawHeader( "Retry-After" ).trimmed();
+  bool isNumber = false;
+  const qint64 seconds = value.toLongLong( &isNumber );
+  if ( isNumber )
+    return std::chrono::milliseconds( std::max<qint64>( 0, seconds ) * 1000 );
+
+  const QDateTime at = QDateTime::fromString( QString::fromLatin1( value ), Qt::RFC2822Date );
+  if ( !at.isValid() )
+    return std::nullopt;
+  return std::chrono::milliseconds( std::max<qint64>( 0, QDateTime::currentDateTimeUtc().msecsTo( at ) ) );
+}
+
+std::optional<qint64> RequestScheduler::clockOffset( const QString &host ) const
+{
+  const Host *known = m_hosts.value( host );
+  return known ? known->clockOffset : std::nullopt;
+}
+
+void RequestScheduler::recordClock( const QString &key, Host &host, QNetworkReply *reply )
+{
+  if ( !reply->hasRawHeader( "Date" ) )
+    return;
+  const QDateTime date = QDateTime::fromString( QString::fromLatin1( reply->rawHeader( "Date" ).trimmed() ), Qt::RFC2822Date );
+  if ( !date.isValid() )
+    return;
+
+  // the header is truncated to the second, on average the server clock is half a second ahead of it
+  const qint64 sample = date.toMSecsSinceEpoch() + 500 - QDateTime::currentMSecsSinceEpoch();
+  const qint64 previous = host.clockOffset.value_or( 0 );
+  const qint64 offset = host.clockOffset ? previous + ( sample - previous ) / 4 : sample;
+  host.clockOffset = offset;
+
+  if ( std::abs( offset - previous ) > clockOffsetLogThreshold )
+    qCInfo(dcNeato()) << "Clock of" << key << "differs from the local clock by" << offset << "ms";
+}
+
+void RequestScheduler::cancel( QNetworkReply *reply )
+{
+  if ( reply->isFinished() )
+    return;
+  reply->setProperty( cancelledProperty, true );
+  reply->abort();
+}
+
+bool RequestScheduler::isTransientFailure( QNetworkReply *reply )
+{
+  const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  return status == 0 || status == 429 || status >= 500;
+}
+
+bool RequestScheduler::isHostFailure( QNetworkReply *reply )
+{
+  const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  return status == 0 || status >= 500;
+}
+
+void RequestScheduler::recordOutcome( const QString &key, Host &host, QNetworkReply *reply )
+{
+  if ( !isHostFailure( reply ) ) {
+    host.failures = 0;
+    if ( host.breaker != Breaker::Closed ) {
+      qCDebug(dcNeato()) << "Host" << key << "is reachable again";
+      host.breaker = Breaker::Closed;
+      host.backoff.reset();
+      emit hostAvailabilityChanged( key, true );
+    }
+    return;
+  }
+
+  ++host.failures;
+  const auto serverDelay = retryAfter( reply );
+  // requests that were already in flight when the breaker opened do not extend the pause
+  if ( host.breaker == Breaker::Open )
+    return;
+  if ( host.breaker == Breaker::Closed && host.failures < failureThreshold && !serverDelay )
+    return;
+
+  std::chrono::milliseconds delay = host.backoff.next();
+  if ( serverDelay )
+    delay = std::max( delay, std::min( *serverDelay, maxRetryAfter ) );
+
+  host.breaker = Breaker::Open;
+  host.openUntil = m_clock->now() + delay.count();
+  qCWarning(dcNeato()) << "Holding back requests to" << key << "for" << delay.count() << "ms after" << host.failures << "failures";
+  host.reopenTimer->start( delay );
+
+  emit hostAvailabilityChanged( key, false );
+}
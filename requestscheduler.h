@@ -0,0 +1,156 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef REQUESTSCHEDULER_H
+#define REQUESTSCHEDULER_H
+
+#include "backoff.h"
+#include "clock.h"
+
+#include <network/networkaccessmanager.h>
+
+#include <QObject>
+#include <QHash>
+#include <QQueue>
+#include <QPointer>
+#include <QNetworkRequest>
+#include <array>
+#include <optional>
+#include <functional>
+
+class QNetworkReply;
+
+/*!
+  Plugin wide HTTP scheduler shared by all Neato accounts.
+
+  Limits the number of concurrent requests per host and sends waiting requests
+  by priority, so a user command never queues behind a sweep of state polls or
+  map downloads. All requests go through the one nymea network manager, which
+  keeps the connections to a host alive and reuses them.
+
+  A circuit breaker per host holds back all requests after repeated network
+  errors or 5xx answers, for a backoff delay or as long as Retry-After asks.
+  Then a single probe request decides whether the host is back. A 429 only
+  means one account or robot used up its quota, it is left to the caller.
+*/
+class RequestScheduler : public QObject
+{
+  Q_OBJECT
+public:
+  // ordered by priority, lower values are sent first
+  enum class Priority {
+    Command,
+    TokenRefresh,
+    StatePoll,
+    RobotList,
+    MapDownload
+  };
+  Q_ENUM(Priority)
+
+  // invoked with the reply once the request got a slot on its host
+  using Started = std::function<void( QNetworkReply *reply )>;
+
+  // the clock drives the breaker pauses, accounts using this scheduler run on it as well
+  explicit RequestScheduler( NetworkAccessManager &nwAccess, Clock &clock, QObject *parent = nullptr );
+  ~RequestScheduler();
+
+  Clock &clock() const;
+
+  // replies handed out and not destroyed yet
+  int liveReplies() const;
+
+  // host is given as returned by hostKey()
+  void setHostLimit( const QString &host, int maxConcurrent );
+  static QString hostKey( const QUrl &url );
+
+  bool isAvailable( const QString &host ) const;
+
+  // server clock minus local clock in ms, estimated from the Date headers of the host's replies
+  std::optional<qint64> clockOffset( const QString &host ) const;
+
+  // delay asked for by a 429 or 503 answer, if any
+  static std::optional<std::chrono::milliseconds> retryAfter( QNetworkReply *reply );
+
+  // true for answers worth retrying later: network errors, 429 and 5xx
+  static bool isTransientFailure( QNetworkReply *reply );
+  // true for network errors and 5xx, the failures that count against the host
+  static bool isHostFailure( QNetworkReply *reply );
+
+  /*!
+  The context is the cancellation token of a request. If it is destroyed before the
+  request is sent, the request is dropped without calling started. Once sent, the reply
+  is aborted and everything connected to it with the context as receiver is disconnected
+  first, so handlers bound to the context never see the aborted reply.
+  */
+  void get( Priority priority, const QNetworkRequest &request, QObject *context, const Started &started );
+  void post( Priority priority, const QNetworkRequest &request, const QByteArray &body, QObject *context, const Started &started );
+
+  // aborts a reply on purpose, it does not count as a failure of its host
+  static void cancel( QNetworkReply *reply );
+
+signals:
+  // false whenever the breaker of a host opens, true once a request succeeded again
+  void hostAvailabilityChanged( const QString &host, bool available );
+
+  // the pause of a host is over but no request is waiting that could probe it
+  void hostProbeDue( const QString &host );
+
+private:
+  struct Pending {
+    bool isPost = false;
+    QNetworkRequest request;
+    QByteArray body;
+    QPointer<QObject> context;
+    Started started;
+  };
+
+  enum class Breaker {
+    Closed,   // requests flow normally
+    Open,     // nothing is sent until openUntil
+    HalfOpen  // a single probe is sent, its outcome closes or reopens the breaker
+  };
+
+  struct Host {
+    int active = 0;
+    int limit = 0;
+    std::array<QQueue<Pending>, 5> queues; // one per priority
+
+    Breaker breaker = Breaker::Closed;
+    int failures = 0;       // consecutive failed requests
+    qint64 openUntil = 0;   // on the scheduler's clock
+    ClockTimer *reopenTimer = nullptr; // pumps the host once openUntil is reached
+    Backoff backoff;
+
+    std::optional<qint64> clockOffset; // smoothed, Date only has a resolution of one second
+  };
+
+  void submit( Priority priority, Pending &&pending );
+  void pump( const QString &hostKey );
+  void recordOutcome( const QString &key, Host &host, QNetworkReply *reply );
+  static void recordClock( const QString &key, Host &host, QNetworkReply *reply );
+
+  NetworkAccessManager *m_networkManager = nullptr;
+  QHash<QString, int> m_limits;
+  QHash<QString, Host *> m_hosts; // never removed, callbacks may add hosts while one is pumped
+  int m_liveReplies = 0;
+  Clock *m_clock = nullptr;
+};
+
+#endif // REQUESTSCHEDULER_H
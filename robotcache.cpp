@@ -0,0 +1,169 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "robotcache.h"
+
+#include <QDataStream>
+#include <QIODevice>
+#include <algorithm>
+#include <type_traits>
+
+namespace {
+  // bump whenever the layout below changes, older snapshots are ignored then
+  constexpr quint8 robotsFormatVersion = 2;  // 2: traits are filled in
+  constexpr quint8 stateFormatVersion  = 1;
+
+  constexpr QDataStream::Version streamVersion = QDataStream::Qt_5_12;
+
+  template<typename Enum>
+  void writeEnum( QDataStream &s, Enum e ) { s << static_cast<qint8>(e); }
+
+  // a damaged snapshot must not produce codes the state mappings can not index
+  template<typename Enum>
+  Enum enumFromCode( int code )
+  {
+    return code < 0 || code > static_cast<int>(JsonDecode::EnumRange<Enum>::last) ? Enum::Invalid : static_cast<Enum>(code);
+  }
+
+  template<typename Enum>
+  void readEnum( QDataStream &s, Enum &e ) { qint8 v = 0; s >> v; e = enumFromCode<Enum>(v); }
+
+  template<typename T, typename Raw = T>
+  void writeOptional( QDataStream &s, const std::optional<T> &o )
+  {
+    s << o.has_value();
+    if ( o )
+      s << static_cast<Raw>(*o);
+  }
+
+  template<typename T, typename Raw = T>
+  void readOptional( QDataStream &s, std::optional<T> &o )
+  {
+    bool present = false;
+    s >> present;
+    o.reset();
+    if ( present ) {
+      Raw v{};
+      s >> v;
+      if constexpr ( std::is_enum_v<T> )
+        o = enumFromCode<T>(v);
+      else
+        o = static_cast<T>(v);
+    }
+  }
+}
+
+QByteArray RobotCache::serializeRobots( const QVector<Neato::Robot> &robots, const QByteArray &etag )
+{
+  QByteArray data;
+  QDataStream s( &data, QIODevice::WriteOnly );
+  s.setVersion( streamVersion );
+  s << robotsFormatVersion << etag << static_cast<quint32>(robots.size());
+  for ( const auto &r : robots )
+    s << r.serial << r.prefix << r.name << r.model << r.secret_key << r.purchased_at << r.linked_at << r.traits;
+  return data;
+}
+
+bool RobotCache::deserializeRobots( const QByteArray &data, QVector<Neato::Robot> &robots, QByteArray &etag )
+{
+  QDataStream s( data );
+  s.setVersion( streamVersion );
+
+  quint8 version = 0;
+  quint32 count = 0;
+  s >> version;
+  if ( version != robotsFormatVersion )
+    return false;
+
+  s >> etag >> count;
+  QVector<Neato::Robot> result;
+  result.reserve( static_cast<int>( std::min<quint32>( count, 1024 ) ) );
+  for ( quint32 i = 0; i < count && s.status() == QDataStream::Ok; ++i ) {
+    Neato::Robot r;
+    s >> r.serial >> r.prefix >> r.name >> r.model >> r.secret_key >> r.purchased_at >> r.linked_at >> r.traits;
+    result.append( std::move(r) );
+  }
+
+  if ( s.status() != QDataStream::Ok )
+    return false;
+  robots = std::move(result);
+  return true;
+}
+
+QByteArray RobotCache::serializeState( const Neato::RobotState &state )
+{
+  QByteArray data;
+  QDataStream s( &data, QIODevice::WriteOnly );
+  s.setVersion( streamVersion );
+  s << stateFormatVersion;
+
+  writeEnum( s, state.state );
+  writeEnum( s, state.action );
+  s << state.error << state.alert;
+
+  writeEnum( s, state.cleaning.category );
+  writeEnum( s, state.cleaning.mode );
+  writeEnum( s, state.cleaning.modifier );
+  writeOptional<Neato::NavigationMode, qint8>( s, state.cleaning.navigationMode );
+  writeOptional<int, qint32>( s, state.cleaning.spotWidth );
+  writeOptional<int, qint32>( s, state.cleaning.spotHeight );
+
+  s << state.details.isCharging << state.details.isDocked << state.details.dockHasBeenSeen
+    << static_cast<qint8>(state.details.charge) << state.details.isScheduleEnabled;
+
+  s << state.availableCommands.start << state.availableCommands.stop << state.availableCommands.pause
+    << state.availableCommands.resume << state.availableCommands.goToBase;
+  return data;
+}
+
+bool RobotCache::deserializeState( const QByteArray &data, Neato::RobotState &state )
+{
+  QDataStream s( data );
+  s.setVersion( streamVersion );
+
+  quint8 version = 0;
+  s >> version;
+  if ( version != stateFormatVersion )
+    return false;
+
+  Neato::RobotState r;
+  readEnum( s, r.state );
+  readEnum( s, r.action );
+  s >> r.error >> r.alert;
+
+  readEnum( s, r.cleaning.category );
+  readEnum( s, r.cleaning.mode );
+  readEnum( s, r.cleaning.modifier );
+  readOptional<Neato::NavigationMode, qint8>( s, r.cleaning.navigationMode );
+  readOptional<int, qint32>( s, r.cleaning.spotWidth );
+  readOptional<int, qint32>( s, r.cleaning.spotHeight );
+
+  qint8 charge = 0;
+  s >> r.details.isCharging >> r.details.isDocked >> r.details.dockHasBeenSeen >> charge >> r.details.isScheduleEnabled;
+  r.details.charge = charge;
+
+  s >> r.availableCommands.start >> r.availableCommands.stop >> r.availableCommands.pause
+    >> r.availableCommands.resume >> r.availableCommands.goToBase;
+
+  if ( s.status() != QDataStream::Ok )
+    return false;
+  state = std::move(r);
+  return true;
+}
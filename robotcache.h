@@ -0,0 +1,41 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef ROBOTCACHE_H
+#define ROBOTCACHE_H
+
+#include "neato.h"
+
+#include <QByteArray>
+
+/*!
+  Compact, versioned binary snapshots of the robot list and the last robot states.
+  They are kept in the plugin storage so things have sensible states right after boot,
+  before Beehive or Nucleo answered.
+*/
+namespace RobotCache {
+  QByteArray serializeRobots( const QVector<Neato::Robot> &robots, const QByteArray &etag );
+  bool deserializeRobots( const QByteArray &data, QVector<Neato::Robot> &robots, QByteArray &etag );
+
+  QByteArray serializeState( const Neato::RobotState &state );
+  bool deserializeState( const QByteArray &data, Neato::RobotState &state );
+}
+
+#endif // ROBOTCACHE_H
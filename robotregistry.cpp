@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "robotregistry.h"
+
+void RobotRegistry::addAccount( Neato *account, const ThingId &accountId )
+{
+  m_accountIds.insert( account, accountId );
+}
+
+void RobotRegistry::removeAccount( Neato *account )
+{
+  m_accountIds.remove( account );
+  m_unavailableAccounts.remove( account );
+  for ( auto it = m_robotAccounts.begin(); it != m_robotAccounts.end(); ) {
+    it->removeAll( account );
+    if ( it->isEmpty() )
+      it = m_robotAccounts.erase( it );
+    else
+      ++it;
+  }
+}
+
+ThingId RobotRegistry::accountId( Neato *account ) const
+{
+  return m_accountIds.value( account );
+}
+
+QStringList RobotRegistry::setAccountAvailable( Neato *account, bool available )
+{
+  if ( available != m_unavailableAccounts.contains( account ) )
+    return {};
+
+  QHash<QString, Neato *> owners;
+  for ( auto it = m_robotAccounts.cbegin(); it != m_robotAccounts.cend(); ++it ) {
+    if ( it->size() > 1 && it->contains( account ) )
+      owners.insert( it.key(), owner( *it ) );
+  }
+
+  if ( available )
+    m_unavailableAccounts.remove( account );
+  else
+    m_unavailableAccounts.insert( account );
+
+  QStringList changed;
+  for ( auto it = owners.cbegin(); it != owners.cend(); ++it ) {
+    if ( owner( m_robotAccounts.value( it.key() ) ) != it.value() )
+      changed.append( it.key() );
+  }
+  return changed;
+}
+
+void RobotRegistry::addRobotThing( const QString &robotSerial, Thing *thing )
+{
+  QVector<Thing *> &things = m_robotThings[ robotSerial ];
+  if ( !things.contains( thing ) )
+    things.append( thing );
+}
+
+void RobotRegistry::removeRobotThing( const QString &robotSerial, Thing *thing )
+{
+  const auto it = m_robotThings.find( robotSerial );
+  if ( it == m_robotThings.end() )
+    return;
+  it->removeAll( thing );
+  if ( it->isEmpty() )
+    m_robotThings.erase( it );
+}
+
+Thing *RobotRegistry::robotThing( const QString &robotSerial ) const
+{
+  const auto it = m_robotThings.constFind( robotSerial );
+  return it != m_robotThings.constEnd() ? it->constFirst() : nullptr;
+}
+
+QVector<Thing *> RobotRegistry::robotThings( const QString &robotSerial ) const
+{
+  return m_robotThings.value( robotSerial );
+}
+
+void RobotRegistry::linkRobot( const QString &robotSerial, Neato *account )
+{
+  QVector<Neato *> &accounts = m_robotAccounts[ robotSerial ];
+  if ( !accounts.contains( account ) )
+    accounts.append( account );
+}
+
+void RobotRegistry::unlinkRobot( const QString &robotSerial, Neato *account )
+{
+  const auto it = m_robotAccounts.find( robotSerial );
+  if ( it == m_robotAccounts.end() )
+    return;
+  it->removeAll( account );
+  if ( it->isEmpty() )
+    m_robotAccounts.erase( it );
+}
+
+Neato *RobotRegistry::account( const QString &robotSerial ) const
+{
+  const auto it = m_robotAccounts.constFind( robotSerial );
+  return it != m_robotAccounts.constEnd() ? owner( *it ) : nullptr;
+}
+
+QVector<Neato *> RobotRegistry::accounts( const QString &robotSerial ) const
+{
+  return m_robotAccounts.value( robotSerial );
+}
+
+Neato *RobotRegistry::owner( const QVector<Neato *> &accounts ) const
+{
+  for ( Neato *account : accounts ) {
+    if ( !m_unavailableAccounts.contains( account ) )
+      return account;
+  }
+  // no session works, keep using the first account so its requests show when it recovers
+  return accounts.isEmpty() ? nullptr : accounts.constFirst();
+}
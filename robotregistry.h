@@ -0,0 +1,76 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef ROBOTREGISTRY_H
+#define ROBOTREGISTRY_H
+
+#include <integrations/thing.h>
+
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class Neato;
+
+/*!
+  Hash indexes between accounts, robot serials and robot things.
+
+  Kept up to date by the plugin on setup, removal and robot list changes,
+  so lookups on the poll and reconciliation paths never scan all things.
+
+  A robot may be shared between several accounts, e.g. by family members.
+  Only one of them, the poll owner, talks to the robot. That is the first
+  linked account with a working session, so when it drops the next account
+  takes over without any extra requests.
+*/
+class RobotRegistry
+{
+public:
+  void addAccount( Neato *account, const ThingId &accountId );
+  void removeAccount( Neato *account );
+  ThingId accountId( Neato *account ) const;
+
+  // returns the robots that got a different poll owner
+  QStringList setAccountAvailable( Neato *account, bool available );
+
+  void addRobotThing( const QString &robotSerial, Thing *thing );
+  void removeRobotThing( const QString &robotSerial, Thing *thing );
+  Thing *robotThing( const QString &robotSerial ) const;
+  // every thing of the robot, states are fanned out to all of them
+  QVector<Thing *> robotThings( const QString &robotSerial ) const;
+
+  void linkRobot( const QString &robotSerial, Neato *account );
+  void unlinkRobot( const QString &robotSerial, Neato *account );
+  // the poll owner, the account a robot is reached through
+  Neato *account( const QString &robotSerial ) const;
+  QVector<Neato *> accounts( const QString &robotSerial ) const;
+
+private:
+  Neato *owner( const QVector<Neato *> &accounts ) const;
+
+  QHash<Neato *, ThingId> m_accountIds;
+  QSet<Neato *> m_unavailableAccounts;
+  QHash<QString, QVector<Thing *>> m_robotThings;
+  QHash<QString, QVector<Neato *>> m_robotAccounts; // in link order
+};
+
+#endif // ROBOTREGISTRY_H
@@ -0,0 +1,6 @@
+TARGET = neatobenchmark
+TEMPLATE = app
+
+include(../common/common.pri)
+
+SOURCES += tst_benchmark.cpp
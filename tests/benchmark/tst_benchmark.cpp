@@ -0,0 +1,328 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "testenvironment.h"
+#include "neatoreplies.h"
+
+#include <QtTest>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <ctime>
+#include <functional>
+#include <memory>
+
+/*!
+  Throughput and latency of the plugin's request path against a local cloud.
+
+  NEATO_TEST_ACCOUNTS accounts with NEATO_TEST_ROBOTS robots each share one
+  scheduler like in nymead. accountBringUp reports how long granting a token
+  and loading the robot list take. statePolling polls every robot again as soon
+  as its previous state arrived and robotCommands does the same with commands,
+  so the host limits and the reply decoding bound the throughput. Tune the run
+  with NEATO_TEST_LATENCY_MS, NEATO_TEST_JITTER_MS, NEATO_TEST_ERROR_RATE and
+  NEATO_BENCHMARK_SECONDS.
+
+  The decode benchmarks measure the reply decoding alone, for robot lists and
+  state payloads up to the size limits of their endpoints. mainThreadPerReply
+  compares the main thread's CPU time per state reply when decoding inline, as
+  before the ReplyDecoder, with handing the body to the decoder's workers.
+*/
+class NeatoBenchmark : public QObject
+{
+  Q_OBJECT
+private slots:
+  void initTestCase();
+  void cleanupTestCase();
+
+  void accountBringUp();
+  void statePolling();
+  void robotCommands();
+
+  void decodeRobotList_data();
+  void decodeRobotList();
+  void decodeStateReply_data();
+  void decodeStateReply();
+  void mainThreadPerReply_data();
+  void mainThreadPerReply();
+
+private:
+  using Issue = std::function<void( Neato *account, const QString &serial, const std::function<void( bool ok )> &done )>;
+
+  // keeps one request per robot of every account in flight for the benchmark duration
+  void saturate( const QString &what, const Issue &issue );
+
+  TestEnvironment m_environment;
+  QVector<Neato *> m_accounts;
+  int m_robots = 0;
+};
+
+namespace {
+  // polls should only be limited by the cloud, not by the request budget
+  const Neato::RateLimits unlimited{ 1000000, 1000000 };
+
+  // accounts connected by accountBringUp, at least
+  constexpr int bringUpSamples = 20;
+
+  double percentileMs( const QVector<qint64> &sortedNs, double percentile )
+  {
+    const int index = std::min<int>( sortedNs.size() - 1, static_cast<int>( sortedNs.size() * percentile ) );
+    return sortedNs.at( index ) / 1e6;
+  }
+
+  QString latencySummary( QVector<qint64> ns )
+  {
+    std::sort( ns.begin(), ns.end() );
+    return QStringLiteral("p50 %1 ms, p99 %2 ms")
+        .arg( percentileMs( ns, 0.5 ), 0, 'f', 2 ).arg( percentileMs( ns, 0.99 ), 0, 'f', 2 );
+  }
+
+  // CPU time of the calling thread, work done on other threads is not counted
+  qint64 threadCpuTimeNs()
+  {
+    timespec now;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &now );
+    return qint64( now.tv_sec ) * 1000000000 + now.tv_nsec;
+  }
+
+  // a state reply grown to about the given size by a field the decoder skips
+  QByteArray paddedStateBody( int size )
+  {
+    QJsonObject state = QJsonDocument::fromJson( MockCloud::robotStateBody( 1 ) ).object();
+    const QJsonValue entry = state.value( QLatin1String("cleaning") );
+    const int entrySize = QJsonDocument( entry.toObject() ).toJson( QJsonDocument::Compact ).size() + 1;
+    const int entries = std::max( 0, ( size - MockCloud::robotStateBody( 1 ).size() ) / entrySize );
+
+    QJsonArray history;
+    for ( int i = 0; i < entries; ++i )
+      history.append( entry );
+    state.insert( QLatin1String("history"), history );
+    return QJsonDocument( state ).toJson( QJsonDocument::Compact );
+  }
+}
+
+void NeatoBenchmark::initTestCase()
+{
+  MockCloud::Config defaults;
+  defaults.robots = 25;
+  const MockCloud::Config config = TestEnvironment::configFromEnvironment( defaults );
+  QVERIFY( m_environment.start( config ) );
+
+  const int accounts = TestEnvironment::intFromEnvironment( "NEATO_TEST_ACCOUNTS", 4 );
+  for ( int i = 0; i < accounts; ++i ) {
+    Neato *neato = m_environment.connectAccount( unlimited );
+    QVERIFY( neato );
+    m_accounts.append( neato );
+  }
+  m_robots = m_accounts.first()->robots().size();
+}
+
+void NeatoBenchmark::cleanupTestCase()
+{
+  qDeleteAll( m_accounts );
+  m_accounts.clear();
+}
+
+void NeatoBenchmark::accountBringUp()
+{
+  const int samples = std::max( bringUpSamples, m_accounts.size() );
+  QVector<qint64> tokens;
+  QVector<qint64> robotLists;
+  for ( int i = 0; i < samples; ++i ) {
+    TestEnvironment::ConnectTimes times;
+    std::unique_ptr<Neato> neato( m_environment.connectAccount( unlimited, nullptr, &times ) );
+    QVERIFY( neato );
+    tokens.append( times.tokenNs );
+    robotLists.append( times.robotsNs );
+  }
+
+  qInfo().noquote() << QStringLiteral("%1 accounts brought up: token grant %2, loadRobots of %3 robots %4")
+                       .arg( samples ).arg( latencySummary( tokens ) ).arg( m_robots ).arg( latencySummary( robotLists ) );
+}
+
+void NeatoBenchmark::saturate( const QString &what, const Issue &issue )
+{
+  const int seconds = TestEnvironment::intFromEnvironment( "NEATO_BENCHMARK_SECONDS", 10 );
+
+  QElapsedTimer clock;
+  QVector<qint64> latencies;
+  int inFlight = 0;
+  int failed = 0;
+  bool running = true;
+
+  // the same robots are seen by every account, each pair is its own request stream
+  std::function<void( Neato *, const QString & )> send = [&]( Neato *account, const QString &serial ) {
+    if ( !running )
+      return;
+    ++inFlight;
+    const qint64 sentAt = clock.nsecsElapsed();
+    issue( account, serial, [&, account, serial, sentAt]( bool ok ) {
+      --inFlight;
+      latencies.append( clock.nsecsElapsed() - sentAt );
+      if ( !ok )
+        ++failed;
+      send( account, serial );
+    });
+  };
+
+  clock.start();
+  for ( Neato *account : qAsConst(m_accounts) ) {
+    for ( const Neato::Robot &robot : account->robots() )
+      send( account, robot.serial );
+  }
+  QTest::qWait( seconds * 1000 );
+  running = false;
+  const qint64 elapsedNs = clock.nsecsElapsed();
+  QTRY_COMPARE_WITH_TIMEOUT( inFlight, 0, 10000 );
+
+  QVERIFY( !latencies.isEmpty() );
+  qInfo().noquote() << QStringLiteral("%1 accounts x %2 robots: %3 %4 in %5 s, %6 requests/s")
+                       .arg( m_accounts.size() ).arg( m_robots ).arg( latencies.size() ).arg( what )
+                       .arg( elapsedNs / 1e9, 0, 'f', 1 ).arg( latencies.size() / ( elapsedNs / 1e9 ), 0, 'f', 1 );
+  qInfo().noquote() << QStringLiteral("latency %1, %2 failed").arg( latencySummary( latencies ) ).arg( failed );
+  qInfo().noquote() << QStringLiteral("peak RSS %1 kB").arg( TestEnvironment::peakResidentSetSize() );
+}
+
+void NeatoBenchmark::statePolling()
+{
+  // everything connected to or scheduled on scope stops with this function
+  QObject scope;
+  QHash<QPair<Neato *, QString>, std::function<void( bool )>> pending;
+  int shed = 0;
+
+  for ( Neato *account : qAsConst(m_accounts) ) {
+    auto finish = [&pending, account]( const QString &serial, bool ok ) {
+      const auto done = pending.take( qMakePair( account, serial ) );
+      if ( done )
+        done( ok );
+    };
+    connect( account, &Neato::robotStateReceived, &scope, [finish]( const QString &serial ) { finish( serial, true ); } );
+    connect( account, &Neato::robotStateFailed, &scope, [finish]( const QString &serial ) { finish( serial, false ); } );
+    connect( account, &Neato::robotStatePollShed, &scope, [&scope, &shed, account]( const QString &serial, qint64 retryInMs ) {
+      ++shed;
+      QTimer::singleShot( retryInMs, &scope, [account, serial]() { account->pollRobotState( serial ); } );
+    });
+  }
+
+  saturate( QStringLiteral("state polls"), [&pending]( Neato *account, const QString &serial, const std::function<void( bool )> &done ) {
+    pending.insert( qMakePair( account, serial ), done );
+    account->pollRobotState( serial );
+  });
+  qInfo().noquote() << QStringLiteral("%1 polls shed").arg( shed );
+}
+
+void NeatoBenchmark::robotCommands()
+{
+  // toggling keeps the commands realistic, the stand-in accepts any of them
+  QHash<QPair<Neato *, QString>, bool> paused;
+  saturate( QStringLiteral("commands"), [&paused]( Neato *account, const QString &serial, const std::function<void( bool )> &done ) {
+    bool &isPaused = paused[ qMakePair( account, serial ) ];
+    isPaused = !isPaused;
+    account->sendRobotCommand( serial, isPaused ? Neato::RobotCommand::PauseCleaning : Neato::RobotCommand::ResumeCleaning, [done]( bool accepted, int ) {
+      done( accepted );
+    });
+  });
+}
+
+void NeatoBenchmark::decodeRobotList_data()
+{
+  QTest::addColumn<int>( "robots" );
+  QTest::newRow( "10 robots" ) << 10;
+  QTest::newRow( "100 robots" ) << 100;
+  QTest::newRow( "3000 robots" ) << 3000; // close to the 1 MB limit of the robot list
+}
+
+void NeatoBenchmark::decodeRobotList()
+{
+  QFETCH( int, robots );
+  const QByteArray body = MockCloud::robotListBody( robots );
+
+  std::optional<QVector<Neato::Robot>> decoded;
+  QBENCHMARK {
+    decoded = NeatoReplies::decodeRobots( body );
+  }
+  QVERIFY( decoded );
+  QCOMPARE( decoded->size(), robots );
+}
+
+void NeatoBenchmark::decodeStateReply_data()
+{
+  QTest::addColumn<QByteArray>( "body" );
+  QTest::newRow( "typical" ) << MockCloud::robotStateBody( 1 );
+  QTest::newRow( "16 kB" ) << paddedStateBody( 16 * 1024 );
+  QTest::newRow( "60 kB" ) << paddedStateBody( 60 * 1024 ); // below the 64 kB limit of robot messages
+}
+
+void NeatoBenchmark::decodeStateReply()
+{
+  QFETCH( QByteArray, body );
+
+  NeatoReplies::StateReply decoded;
+  QBENCHMARK {
+    decoded = NeatoReplies::decodeStateReply( body );
+  }
+  QVERIFY( decoded.valid );
+  QVERIFY( decoded.services );
+}
+
+void NeatoBenchmark::mainThreadPerReply_data()
+{
+  QTest::addColumn<QByteArray>( "body" );
+  QTest::addColumn<bool>( "offloaded" );
+  QTest::newRow( "typical, inline" ) << MockCloud::robotStateBody( 1 ) << false;
+  QTest::newRow( "typical, decoder" ) << MockCloud::robotStateBody( 1 ) << true;
+  QTest::newRow( "60 kB, inline" ) << paddedStateBody( 60 * 1024 ) << false;
+  QTest::newRow( "60 kB, decoder" ) << paddedStateBody( 60 * 1024 ) << true;
+}
+
+void NeatoBenchmark::mainThreadPerReply()
+{
+  QFETCH( QByteArray, body );
+  QFETCH( bool, offloaded );
+  constexpr int replies = 2000;
+
+  ReplyDecoder decoder;
+  QObject context;
+  int applied = 0;
+  auto apply = [&applied]( NeatoReplies::StateReply &&decoded ) {
+    if ( decoded.valid )
+      ++applied;
+  };
+
+  // waiting for the workers sleeps, only the queued callbacks add to the main thread's time
+  const qint64 startedAt = threadCpuTimeNs();
+  for ( int i = 0; i < replies; ++i ) {
+    if ( offloaded )
+      decoder.run( &context, [body]() { return NeatoReplies::decodeStateReply( body ); }, apply );
+    else
+      apply( NeatoReplies::decodeStateReply( body ) );
+  }
+  QTRY_COMPARE_WITH_TIMEOUT( applied, replies, 30000 );
+  const qint64 mainThreadNs = threadCpuTimeNs() - startedAt;
+
+  qInfo().noquote() << QStringLiteral("%1 us main thread time per reply of %2 bytes, %3")
+                       .arg( mainThreadNs / 1e3 / replies, 0, 'f', 2 ).arg( body.size() ).arg( offloaded ? QLatin1String("decoded on the workers") : QLatin1String("decoded inline") );
+}
+
+QTEST_GUILESS_MAIN(NeatoBenchmark)
+
+#include "tst_benchmark.moc"
@@ -0,0 +1,43 @@
+# the plugin units under test, built against libnymea outside of nymead
+CONFIG += c++17 link_pkgconfig testcase
+PKGCONFIG += nymea
+QT += network testlib
+QT -= gui
+
+PLUGIN_DIR = $$PWD/../..
+
+INCLUDEPATH += $$PWD \
+               $$PLUGIN_DIR
+
+SOURCES += $$PLUGIN_DIR/neato.cpp \
+           $$PLUGIN_DIR/pollscheduler.cpp \
+           $$PLUGIN_DIR/requestscheduler.cpp \
+           $$PLUGIN_DIR/requestmetrics.cpp \
+           $$PLUGIN_DIR/tracebuffer.cpp \
+           $$PLUGIN_DIR/backoff.cpp \
+           $$PLUGIN_DIR/tokenbucket.cpp \
+           $$PLUGIN_DIR/replydecoder.cpp \
+           $$PLUGIN_DIR/neatoreplies.cpp \
+           $$PLUGIN_DIR/clock.cpp \
+           $$PWD/mockcloud.cpp \
+           $$PWD/virtualclock.cpp \
+           $$PWD/testnetworkmanager.cpp \
+           $$PWD/testenvironment.cpp \
+           $$PWD/plugininfo.cpp
+
+HEADERS += $$PLUGIN_DIR/neato.h \
+           $$PLUGIN_DIR/pollscheduler.h \
+           $$PLUGIN_DIR/requestscheduler.h \
+           $$PLUGIN_DIR/requestmetrics.h \
+           $$PLUGIN_DIR/tracebuffer.h \
+           $$PLUGIN_DIR/backoff.h \
+           $$PLUGIN_DIR/tokenbucket.h \
+           $$PLUGIN_DIR/replydecoder.h \
+           $$PLUGIN_DIR/neatoreplies.h \
+           $$PLUGIN_DIR/clock.h \
+           $$PLUGIN_DIR/jsondecode.h \
+           $$PWD/mockcloud.h \
+           $$PWD/virtualclock.h \
+           $$PWD/testnetworkmanager.h \
+           $$PWD/testenvironment.h \
+           $$PWD/extern-plugininfo.h
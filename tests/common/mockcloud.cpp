@@ -0,0 +1,412 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mockcloud.h"
+#include "clock.h"
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QDateTime>
+#include <QLocale>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMessageAuthenticationCode>
+#include <QRandomGenerator>
+
+namespace {
+  QByteArray reasonPhrase( int status )
+  {
+    switch ( status ) {
+      case 200: return QByteArrayLiteral("OK");
+      case 304: return QByteArrayLiteral("Not Modified");
+      case 401: return QByteArrayLiteral("Unauthorized");
+      case 404: return QByteArrayLiteral("Not Found");
+      case 503: return QByteArrayLiteral("Service Unavailable");
+    }
+    return QByteArrayLiteral("Unknown");
+  }
+
+  QByteArray httpDate()
+  {
+    return QLocale::c().toString( QDateTime::currentDateTimeUtc(), QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'") ).toLatin1();
+  }
+
+  QByteArray json( const QJsonObject &object )
+  {
+    return QJsonDocument( object ).toJson( QJsonDocument::Compact );
+  }
+
+  QByteArray json( const QJsonArray &array )
+  {
+    return QJsonDocument( array ).toJson( QJsonDocument::Compact );
+  }
+
+  // index of a serial built by robotSerial(), -1 for anything else
+  int robotIndex( const QString &serial, int robots )
+  {
+    if ( !serial.startsWith( QLatin1String("mock") ) )
+      return -1;
+    bool ok = false;
+    const int index = serial.midRef( 4 ).toInt( &ok );
+    return ok && index >= 0 && index < robots ? index : -1;
+  }
+}
+
+MockCloud::MockCloud( const Config &config )
+  : m_config( config )
+  , m_clock( config.clock ? config.clock : &Clock::steady() )
+{
+}
+
+MockCloud::~MockCloud()
+{
+  if ( m_thread.isRunning() ) {
+    QMetaObject::invokeMethod( this, &MockCloud::shutdown, Qt::BlockingQueuedConnection );
+    m_thread.quit();
+    m_thread.wait();
+  }
+}
+
+bool MockCloud::start()
+{
+  moveToThread( &m_thread );
+  m_thread.start();
+  QMetaObject::invokeMethod( this, &MockCloud::listen, Qt::BlockingQueuedConnection );
+  return m_beehivePort && m_nucleoPort;
+}
+
+QUrl MockCloud::beehiveUrl() const
+{
+  return QUrl( QStringLiteral("http://127.0.0.1:%1").arg( m_beehivePort ) );
+}
+
+QUrl MockCloud::nucleoUrl() const
+{
+  return QUrl( QStringLiteral("http://127.0.0.1:%1").arg( m_nucleoPort ) );
+}
+
+QString MockCloud::robotSerial( int index )
+{
+  return QStringLiteral("mock%1").arg( index, 6, 10, QLatin1Char('0') );
+}
+
+QByteArray MockCloud::robotSecret( int index )
+{
+  return QByteArrayLiteral("secret-") + QByteArray::number( index );
+}
+
+quint64 MockCloud::requests( Route route ) const
+{
+  return m_requests[ static_cast<int>( route ) ];
+}
+
+quint64 MockCloud::failures() const
+{
+  return m_failures;
+}
+
+quint64 MockCloud::rejected() const
+{
+  return m_rejected;
+}
+
+quint64 MockCloud::tokensIssued() const
+{
+  return m_tokensIssued;
+}
+
+void MockCloud::listen()
+{
+  m_robotsBody = robotListBody( m_config.robots );
+  m_robotsETag = QByteArrayLiteral("\"robots-") + QByteArray::number( m_config.robots ) + '"';
+
+  m_beehive = new QTcpServer( this );
+  m_nucleo = new QTcpServer( this );
+  connect( m_beehive, &QTcpServer::newConnection, this, [this]() { acceptConnections( m_beehive, false ); } );
+  connect( m_nucleo, &QTcpServer::newConnection, this, [this]() { acceptConnections( m_nucleo, true ); } );
+  if ( m_beehive->listen( QHostAddress::LocalHost ) )
+    m_beehivePort = m_beehive->serverPort();
+  if ( m_nucleo->listen( QHostAddress::LocalHost ) )
+    m_nucleoPort = m_nucleo->serverPort();
+}
+
+void MockCloud::shutdown()
+{
+  // the connections are children of their server
+  m_buffers.clear();
+  delete m_beehive;
+  delete m_nucleo;
+  m_beehive = nullptr;
+  m_nucleo = nullptr;
+}
+
+void MockCloud::acceptConnections( QTcpServer *server, bool nucleo )
+{
+  while ( QTcpSocket *socket = server->nextPendingConnection() ) {
+    connect( socket, &QTcpSocket::readyRead, this, [this, socket, nucleo]() { readRequests( socket, nucleo ); } );
+    connect( socket, &QTcpSocket::disconnected, this, [this, socket]() {
+      m_buffers.remove( socket );
+      socket->deleteLater();
+    });
+  }
+}
+
+void MockCloud::readRequests( QTcpSocket *socket, bool nucleo )
+{
+  QByteArray &buffer = m_buffers[ socket ];
+  buffer += socket->readAll();
+
+  // the network manager does not pipeline, but a connection may still deliver several requests in one read
+  forever {
+    const int headerEnd = buffer.indexOf( "\r\n\r\n" );
+    if ( headerEnd < 0 )
+      return;
+
+    Request request;
+    const QList<QByteArray> lines = buffer.left( headerEnd ).split( '\n' );
+    const QList<QByteArray> requestLine = lines.first().trimmed().split( ' ' );
+    if ( requestLine.size() < 2 ) {
+      socket->disconnectFromHost();
+      return;
+    }
+    request.method = requestLine.at( 0 );
+    request.path = requestLine.at( 1 );
+    for ( int i = 1; i < lines.size(); ++i ) {
+      const QByteArray &line = lines.at( i );
+      const int colon = line.indexOf( ':' );
+      if ( colon > 0 )
+        request.headers.insert( line.left( colon ).trimmed().toLower(), line.mid( colon + 1 ).trimmed() );
+    }
+
+    const int length = request.headers.value( "content-length" ).toInt();
+    if ( buffer.size() < headerEnd + 4 + length )
+      return;
+    request.body = buffer.mid( headerEnd + 4, length );
+    buffer.remove( 0, headerEnd + 4 + length );
+
+    const Response response = handle( request, nucleo );
+    const int delay = m_config.latencyMs + QRandomGenerator::global()->bounded( m_config.jitterMs + 1 );
+    QTimer::singleShot( delay, socket, [this, socket, response]() { send( socket, response ); } );
+  }
+}
+
+MockCloud::Response MockCloud::handle( const Request &request, bool nucleo )
+{
+  const QByteArray path = request.path.left( request.path.indexOf( '?' ) );
+  Route route = Route::Unknown;
+  if ( nucleo && request.method == "POST" && path.startsWith( "/vendors/neato/robots/" ) && path.endsWith( "/messages" ) )
+    route = Route::Messages;
+  else if ( !nucleo && request.method == "POST" && path == "/oauth2/token" )
+    route = Route::Token;
+  else if ( !nucleo && request.method == "GET" && path == "/users/me/robots" )
+    route = Route::Robots;
+  else if ( !nucleo && request.method == "GET" && path.startsWith( "/users/me/robots/" ) && path.endsWith( "maps" ) )
+    route = Route::Maps;
+  ++m_requests[ static_cast<int>( route ) ];
+
+  Response response;
+  if ( route == Route::Unknown ) {
+    ++m_rejected;
+    response.status = 404;
+    return response;
+  }
+
+  if ( m_config.errorRate > 0 && QRandomGenerator::global()->generateDouble() < m_config.errorRate ) {
+    ++m_failures;
+    response.status = 503;
+    return response;
+  }
+
+  switch ( route ) {
+    case Route::Token:
+      return handleToken( request );
+    case Route::Messages:
+      return handleMessage( request );
+    default:
+      return handleBeehive( request );
+  }
+}
+
+MockCloud::Response MockCloud::handleToken( const Request &request )
+{
+  Q_UNUSED(request)
+
+  // forget what expired, a long soak issues many tokens
+  const qint64 now = m_clock->now();
+  for ( auto it = m_tokens.begin(); it != m_tokens.end(); ) {
+    if ( it.value() <= now )
+      it = m_tokens.erase( it );
+    else
+      ++it;
+  }
+
+  const QByteArray number = QByteArray::number( ++m_tokensIssued );
+  const QByteArray token = "access-" + number;
+  m_tokens.insert( token, now + qint64( m_config.tokenLifetimeSeconds ) * 1000 );
+
+  Response response;
+  response.body = json( QJsonObject{
+    { "access_token", QString::fromLatin1( token ) },
+    { "refresh_token", QString::fromLatin1( "refresh-" + number ) },
+    { "expires_in", m_config.tokenLifetimeSeconds }
+  });
+  return response;
+}
+
+bool MockCloud::authorized( const Request &request ) const
+{
+  const QByteArray authorization = request.headers.value( "authorization" );
+  if ( !authorization.startsWith( "Bearer " ) )
+    return false;
+  const auto expiry = m_tokens.constFind( authorization.mid( 7 ) );
+  return expiry != m_tokens.constEnd() && *expiry > m_clock->now();
+}
+
+MockCloud::Response MockCloud::handleBeehive( const Request &request )
+{
+  Response response;
+  if ( !authorized( request ) ) {
+    ++m_rejected;
+    response.status = 401;
+    return response;
+  }
+
+  const QByteArray path = request.path.left( request.path.indexOf( '?' ) );
+  if ( path == "/users/me/robots" ) {
+    response.headers.append( { "ETag", m_robotsETag } );
+    if ( request.headers.value( "if-none-match" ) == m_robotsETag )
+      response.status = 304;
+    else
+      response.body = m_robotsBody;
+    return response;
+  }
+
+  // /users/me/robots/<serial>/maps or /users/me/robots/<serial>/persistent_maps
+  const QList<QByteArray> segments = path.split( '/' );
+  const QString serial = QString::fromLatin1( segments.value( 4 ) );
+  if ( robotIndex( serial, m_config.robots ) < 0 ) {
+    ++m_rejected;
+    response.status = 404;
+    return response;
+  }
+  response.body = maps( serial, segments.value( 5 ) == "persistent_maps" );
+  return response;
+}
+
+MockCloud::Response MockCloud::handleMessage( const Request &request )
+{
+  Response response;
+
+  // /vendors/neato/robots/<serial>/messages
+  const QString serial = QString::fromLatin1( request.path.split( '/' ).value( 4 ) );
+  const int index = robotIndex( serial, m_config.robots );
+  if ( index < 0 ) {
+    ++m_rejected;
+    response.status = 404;
+    return response;
+  }
+
+  const QByteArray stringToSign = serial.toLower().toLatin1() + '\n' + request.headers.value( "date" ) + '\n' + request.body;
+  const QByteArray expected = "NEATOAPP " + QMessageAuthenticationCode::hash( stringToSign, robotSecret( index ), QCryptographicHash::Sha256 ).toHex();
+  if ( request.headers.value( "authorization" ) != expected ) {
+    ++m_rejected;
+    response.status = 401;
+    return response;
+  }
+
+  const QJsonObject message = QJsonDocument::fromJson( request.body ).object();
+  if ( message.value( QLatin1String("cmd") ).toString() == QLatin1String("getRobotState") )
+    response.body = robotStateBody( m_stateCounters[ serial ]++ );
+  else
+    response.body = json( QJsonObject{ { "version", 1 }, { "reqId", message.value( QLatin1String("reqId") ) }, { "result", "ok" } } );
+  return response;
+}
+
+void MockCloud::send( QTcpSocket *socket, const Response &response )
+{
+  QByteArray data = "HTTP/1.1 " + QByteArray::number( response.status ) + ' ' + reasonPhrase( response.status ) + "\r\n";
+  data += "Date: " + httpDate() + "\r\n";
+  data += "Content-Type: application/json\r\n";
+  data += "Content-Length: " + QByteArray::number( response.body.size() ) + "\r\n";
+  data += "Connection: keep-alive\r\n";
+  for ( const auto &header : response.headers )
+    data += header.first + ": " + header.second + "\r\n";
+  data += "\r\n";
+  data += response.body;
+  socket->write( data );
+}
+
+QByteArray MockCloud::robotListBody( int count )
+{
+  QJsonArray robots;
+  for ( int i = 0; i < count; ++i ) {
+    robots.append( QJsonObject{
+      { "serial", robotSerial( i ) },
+      { "prefix", "mock" },
+      { "name", QStringLiteral("Robot %1").arg( i ) },
+      { "model", "BotVacD7Connected" },
+      { "secret_key", QString::fromLatin1( robotSecret( i ) ) },
+      { "purchased_at", "2020-01-01T00:00:00Z" },
+      { "linked_at", "2020-01-02T00:00:00Z" },
+      { "traits", QJsonArray{ "maps" } }
+    });
+  }
+  return json( robots );
+}
+
+QByteArray MockCloud::robotStateBody( quint32 n )
+{
+  // consecutive polls report changes
+  const bool busy = n % 2;
+  return json( QJsonObject{
+    { "version", 1 },
+    { "reqId", "1" },
+    { "result", "ok" },
+    { "error", QJsonValue() },
+    { "alert", QJsonValue() },
+    { "state", busy ? 2 : 1 },
+    { "action", busy ? 1 : 0 },
+    { "cleaning", QJsonObject{ { "category", 4 }, { "mode", 1 }, { "modifier", 1 }, { "navigationMode", 1 }, { "spotWidth", 0 }, { "spotHeight", 0 } } },
+    { "details", QJsonObject{ { "isCharging", !busy }, { "isDocked", !busy }, { "isScheduleEnabled", false }, { "dockHasBeenSeen", true }, { "charge", int( 100 - n % 100 ) } } },
+    { "availableCommands", QJsonObject{ { "start", !busy }, { "stop", busy }, { "pause", busy }, { "resume", false }, { "goToBase", busy } } },
+    { "availableServices", QJsonObject{ { "houseCleaning", "basic-3" }, { "maps", "basic-2" } } },
+    { "meta", QJsonObject{ { "modelName", "BotVacD7Connected" }, { "firmware", "4.5.3-189" } } }
+  });
+}
+
+QByteArray MockCloud::maps( const QString &serial, bool persistent ) const
+{
+  QJsonArray list;
+  for ( int i = 0; i < m_config.mapsPerRobot; ++i ) {
+    QJsonObject map{
+      { "id", QStringLiteral("%1-map-%2").arg( serial ).arg( i ) },
+      { "url", beehiveUrl().toString() + QStringLiteral("/maps/%1/%2.png").arg( serial ).arg( i ) },
+      { "url_valid_for_seconds", 3600 }
+    };
+    if ( persistent )
+      map.insert( QLatin1String("name"), QStringLiteral("Floor %1").arg( i ) );
+    else
+      map.insert( QLatin1String("start_at"), QDateTime::currentDateTimeUtc().addSecs( -3600 * ( i + 1 ) ).toString( Qt::ISODate ) );
+    list.append( map );
+  }
+  return persistent ? json( list ) : json( QJsonObject{ { "maps", list } } );
+}
@@ -0,0 +1,137 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MOCKCLOUD_H
+#define MOCKCLOUD_H
+
+#include <QObject>
+#include <QHash>
+#include <QThread>
+#include <QUrl>
+#include <QVector>
+#include <atomic>
+
+class Clock;
+class QTcpServer;
+class QTcpSocket;
+
+/*!
+  In-process stand-in for the Beehive and Nucleo services.
+
+  Both services listen on their own local port, so the plugin's per host limits
+  and circuit breakers see two hosts like in production. The servers run on a
+  thread of their own and answer every request after the configured latency, a
+  share of the requests fails with 503. Access tokens expire after the configured
+  lifetime on the configured clock and Nucleo messages are only accepted with a
+  valid signature.
+*/
+class MockCloud : public QObject
+{
+  Q_OBJECT
+public:
+  struct Config {
+    int robots = 10;
+    int latencyMs = 20;
+    int jitterMs = 10;           // added to the latency, uniformly distributed
+    double errorRate = 0;        // share of requests answered with 503
+    int tokenLifetimeSeconds = 3600;
+    int mapsPerRobot = 2;
+    const Clock *clock = nullptr; // runs the token lifetime, the steady clock if not set
+  };
+
+  enum class Route {
+    Token,
+    Robots,
+    Maps,
+    Messages,
+    Unknown
+  };
+
+  explicit MockCloud( const Config &config );
+  ~MockCloud();
+
+  // starts listening on two free local ports, false if that failed
+  bool start();
+
+  QUrl beehiveUrl() const;
+  QUrl nucleoUrl() const;
+
+  static QString robotSerial( int index );
+  static QByteArray robotSecret( int index );
+
+  // bodies as served, the n-th state of a robot alternates between idle and busy
+  static QByteArray robotListBody( int robots );
+  static QByteArray robotStateBody( quint32 n );
+
+  // counters since start, may be read from any thread
+  quint64 requests( Route route ) const;
+  quint64 failures() const;      // injected 503s
+  quint64 rejected() const;      // expired tokens, bad signatures and unknown routes
+  quint64 tokensIssued() const;
+
+private:
+  struct Request {
+    QByteArray method;
+    QByteArray path;
+    QHash<QByteArray, QByteArray> headers; // lower case names
+    QByteArray body;
+  };
+
+  struct Response {
+    int status = 200;
+    QByteArray body;
+    QList<QPair<QByteArray, QByteArray>> headers;
+  };
+
+  void listen();
+  void shutdown();
+  void acceptConnections( QTcpServer *server, bool nucleo );
+  void readRequests( QTcpSocket *socket, bool nucleo );
+  Response handle( const Request &request, bool nucleo );
+  Response handleToken( const Request &request );
+  Response handleBeehive( const Request &request );
+  Response handleMessage( const Request &request );
+  bool authorized( const Request &request ) const;
+  void send( QTcpSocket *socket, const Response &response );
+
+  QByteArray maps( const QString &serial, bool persistent ) const;
+
+  Config m_config;
+  const Clock *m_clock;
+  QThread m_thread;
+  QTcpServer *m_beehive = nullptr;
+  QTcpServer *m_nucleo = nullptr;
+  quint16 m_beehivePort = 0;
+  quint16 m_nucleoPort = 0;
+  QHash<QTcpSocket *, QByteArray> m_buffers;
+
+  // only touched on the server thread
+  QHash<QByteArray, qint64> m_tokens; // access token to expiry on m_clock
+  QHash<QString, quint32> m_stateCounters;
+  QByteArray m_robotsBody;
+  QByteArray m_robotsETag;
+
+  std::atomic<quint64> m_requests[5] = {};
+  std::atomic<quint64> m_failures{ 0 };
+  std::atomic<quint64> m_rejected{ 0 };
+  std::atomic<quint64> m_tokensIssued{ 0 };
+};
+
+#endif // MOCKCLOUD_H
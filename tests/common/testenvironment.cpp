@@ -0,0 +1,143 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "testenvironment.h"
+
+#include <QFile>
+#include <QElapsedTimer>
+#include <QSignalSpy>
+
+namespace {
+  constexpr int connectTimeoutMs = 10000;
+
+  qint64 statusField( const QByteArray &name )
+  {
+    QFile status( QStringLiteral("/proc/self/status") );
+    if ( !status.open( QIODevice::ReadOnly ) )
+      return 0;
+    for ( const QByteArray &line : status.readAll().split( '\n' ) ) {
+      if ( line.startsWith( name ) )
+        return line.mid( name.size() ).simplified().split( ' ' ).first().toLongLong();
+    }
+    return 0;
+  }
+}
+
+TestEnvironment::TestEnvironment() = default;
+
+TestEnvironment::~TestEnvironment() = default;
+
+bool TestEnvironment::start( const MockCloud::Config &config, Clock &clock )
+{
+  if ( qEnvironmentVariableIsEmpty( "NEATO_BEEHIVE_URL" ) && qEnvironmentVariableIsEmpty( "NEATO_NUCLEO_URL" ) ) {
+    MockCloud::Config cloudConfig = config;
+    cloudConfig.clock = &clock;
+    m_cloud.reset( new MockCloud( cloudConfig ) );
+    if ( !m_cloud->start() )
+      return false;
+    qputenv( "NEATO_BEEHIVE_URL", m_cloud->beehiveUrl().toEncoded() );
+    qputenv( "NEATO_NUCLEO_URL", m_cloud->nucleoUrl().toEncoded() );
+  }
+
+  m_endpoints = Neato::Endpoints::fromEnvironment();
+  m_scheduler.reset( new RequestScheduler( m_network, clock ) );
+  m_endpoints.applyHostLimits( *m_scheduler );
+  m_decoder.reset( new ReplyDecoder() );
+  return true;
+}
+
+MockCloud *TestEnvironment::cloud() const
+{
+  return m_cloud.get();
+}
+
+RequestScheduler &TestEnvironment::scheduler()
+{
+  return *m_scheduler;
+}
+
+ReplyDecoder &TestEnvironment::decoder()
+{
+  return *m_decoder;
+}
+
+const Neato::Endpoints &TestEnvironment::endpoints() const
+{
+  return m_endpoints;
+}
+
+Neato *TestEnvironment::connectAccount( const Neato::RateLimits &limits, QObject *parent, ConnectTimes *times )
+{
+  auto *neato = new Neato( *m_scheduler, *m_decoder, m_endpoints, QByteArrayLiteral("client"), QByteArrayLiteral("secret"), parent );
+  neato->setRateLimits( limits );
+
+  QElapsedTimer clock;
+  clock.start();
+  QSignalSpy authenticated( neato, &Neato::authenticated );
+  neato->fetchAcessTokenFromRefreshToken( qEnvironmentVariable( "NEATO_TEST_REFRESH_TOKEN", QStringLiteral("refresh") ) );
+  if ( !authenticated.wait( connectTimeoutMs ) || !authenticated.first().first().toBool() ) {
+    delete neato;
+    return nullptr;
+  }
+  const qint64 tokenNs = clock.nsecsElapsed();
+
+  QSignalSpy loaded( neato, &Neato::robotsLoaded );
+  neato->loadRobots();
+  if ( !loaded.wait( connectTimeoutMs ) || neato->robots().isEmpty() ) {
+    delete neato;
+    return nullptr;
+  }
+  if ( times ) {
+    times->tokenNs = tokenNs;
+    times->robotsNs = clock.nsecsElapsed() - tokenNs;
+  }
+  return neato;
+}
+
+MockCloud::Config TestEnvironment::configFromEnvironment( const MockCloud::Config &defaults )
+{
+  MockCloud::Config config = defaults;
+  config.robots = intFromEnvironment( "NEATO_TEST_ROBOTS", config.robots );
+  config.latencyMs = intFromEnvironment( "NEATO_TEST_LATENCY_MS", config.latencyMs );
+  config.jitterMs = intFromEnvironment( "NEATO_TEST_JITTER_MS", config.jitterMs );
+  config.tokenLifetimeSeconds = intFromEnvironment( "NEATO_TEST_TOKEN_LIFETIME", config.tokenLifetimeSeconds );
+  bool ok = false;
+  const double errorRate = qEnvironmentVariable( "NEATO_TEST_ERROR_RATE" ).toDouble( &ok );
+  if ( ok )
+    config.errorRate = errorRate;
+  return config;
+}
+
+int TestEnvironment::intFromEnvironment( const char *name, int fallback )
+{
+  bool ok = false;
+  const int value = qEnvironmentVariableIntValue( name, &ok );
+  return ok ? value : fallback;
+}
+
+qint64 TestEnvironment::residentSetSize()
+{
+  return statusField( QByteArrayLiteral("VmRSS:") );
+}
+
+qint64 TestEnvironment::peakResidentSetSize()
+{
+  return statusField( QByteArrayLiteral("VmHWM:") );
+}
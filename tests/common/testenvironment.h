@@ -0,0 +1,79 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TESTENVIRONMENT_H
+#define TESTENVIRONMENT_H
+
+#include "mockcloud.h"
+#include "testnetworkmanager.h"
+#include "requestscheduler.h"
+#include "replydecoder.h"
+#include "neato.h"
+
+#include <memory>
+
+/*!
+  What the plugin shares between its accounts, set up like in nymead.
+
+  Talks to the cloud named by NEATO_BEEHIVE_URL and NEATO_NUCLEO_URL. If neither
+  is set, an in-process MockCloud is started and both variables point to it.
+*/
+class TestEnvironment
+{
+public:
+  TestEnvironment();
+  ~TestEnvironment();
+
+  // the scheduler, its accounts and a started MockCloud all run on clock
+  bool start( const MockCloud::Config &config, Clock &clock = Clock::steady() );
+
+  // nullptr when running against an external cloud
+  MockCloud *cloud() const;
+  RequestScheduler &scheduler();
+  ReplyDecoder &decoder();
+  const Neato::Endpoints &endpoints() const;
+
+  // how long the steps of connectAccount took
+  struct ConnectTimes {
+    qint64 tokenNs = 0;  // access token granted for the refresh token
+    qint64 robotsNs = 0; // robot list loaded afterwards
+  };
+
+  // an account with a valid access token and its robot list loaded, nullptr if that failed
+  // accounts must be deleted before the environment
+  Neato *connectAccount( const Neato::RateLimits &limits, QObject *parent = nullptr, ConnectTimes *times = nullptr );
+
+  // MockCloud::Config with the NEATO_TEST_* overrides applied
+  static MockCloud::Config configFromEnvironment( const MockCloud::Config &defaults );
+  static int intFromEnvironment( const char *name, int fallback );
+
+  // resident set size in kB from /proc, 0 where it is not available
+  static qint64 residentSetSize();
+  static qint64 peakResidentSetSize();
+
+private:
+  std::unique_ptr<MockCloud> m_cloud;
+  TestNetworkManager m_network;
+  std::unique_ptr<RequestScheduler> m_scheduler;
+  std::unique_ptr<ReplyDecoder> m_decoder;
+  Neato::Endpoints m_endpoints;
+};
+
+#endif // TESTENVIRONMENT_H
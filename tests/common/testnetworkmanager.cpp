@@ -0,0 +1,107 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "testnetworkmanager.h"
+
+TestNetworkManager::TestNetworkManager( QObject *parent )
+  : NetworkAccessManager( parent )
+  , m_manager( new QNetworkAccessManager(this) )
+{
+}
+
+bool TestNetworkManager::available() const
+{
+  return true;
+}
+
+bool TestNetworkManager::enabled() const
+{
+  return true;
+}
+
+void TestNetworkManager::setEnabled( bool enabled )
+{
+  Q_UNUSED(enabled)
+}
+
+QNetworkReply *TestNetworkManager::get( const QNetworkRequest &request )
+{
+  return m_manager->get( request );
+}
+
+QNetworkReply *TestNetworkManager::deleteResource( const QNetworkRequest &request )
+{
+  return m_manager->deleteResource( request );
+}
+
+QNetworkReply *TestNetworkManager::head( const QNetworkRequest &request )
+{
+  return m_manager->head( request );
+}
+
+QNetworkReply *TestNetworkManager::post( const QNetworkRequest &request, QIODevice *data )
+{
+  return m_manager->post( request, data );
+}
+
+QNetworkReply *TestNetworkManager::post( const QNetworkRequest &request, const QByteArray &data )
+{
+  return m_manager->post( request, data );
+}
+
+QNetworkReply *TestNetworkManager::post( const QNetworkRequest &request, QHttpMultiPart *multiPart )
+{
+  return m_manager->post( request, multiPart );
+}
+
+QNetworkReply *TestNetworkManager::put( const QNetworkRequest &request, QIODevice *data )
+{
+  return m_manager->put( request, data );
+}
+
+QNetworkReply *TestNetworkManager::put( const QNetworkRequest &request, const QByteArray &data )
+{
+  return m_manager->put( request, data );
+}
+
+QNetworkReply *TestNetworkManager::put( const QNetworkRequest &request, QHttpMultiPart *multiPart )
+{
+  return m_manager->put( request, multiPart );
+}
+
+QNetworkReply *TestNetworkManager::sendCustomRequest( const QNetworkRequest &request, const QByteArray &verb, QIODevice *data )
+{
+  return m_manager->sendCustomRequest( request, verb, data );
+}
+
+void TestNetworkManager::setCache( QAbstractNetworkCache *cache )
+{
+  m_manager->setCache( cache );
+}
+
+QNetworkConfiguration TestNetworkManager::configuration() const
+{
+  return m_manager->configuration();
+}
+
+void TestNetworkManager::setConfiguration( const QNetworkConfiguration &config )
+{
+  m_manager->setConfiguration( config );
+}
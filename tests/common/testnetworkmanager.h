@@ -0,0 +1,66 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TESTNETWORKMANAGER_H
+#define TESTNETWORKMANAGER_H
+
+#include <network/networkaccessmanager.h>
+
+#include <QNetworkAccessManager>
+
+/*!
+  The nymea network manager interface on top of a plain QNetworkAccessManager,
+  so the request scheduler can run outside of nymead.
+*/
+class TestNetworkManager : public NetworkAccessManager
+{
+  Q_OBJECT
+public:
+  explicit TestNetworkManager( QObject *parent = nullptr );
+
+  bool available() const override;
+  bool enabled() const override;
+
+  QNetworkReply *get( const QNetworkRequest &request ) override;
+  QNetworkReply *deleteResource( const QNetworkRequest &request ) override;
+  QNetworkReply *head( const QNetworkRequest &request ) override;
+
+  QNetworkReply *post( const QNetworkRequest &request, QIODevice *data ) override;
+  QNetworkReply *post( const QNetworkRequest &request, const QByteArray &data ) override;
+  QNetworkReply *post( const QNetworkRequest &request, QHttpMultiPart *multiPart ) override;
+
+  QNetworkReply *put( const QNetworkRequest &request, QIODevice *data ) override;
+  QNetworkReply *put( const QNetworkRequest &request, const QByteArray &data ) override;
+  QNetworkReply *put( const QNetworkRequest &request, QHttpMultiPart *multiPart ) override;
+
+  QNetworkReply *sendCustomRequest( const QNetworkRequest &request, const QByteArray &verb, QIODevice *data = nullptr ) override;
+
+  void setCache( QAbstractNetworkCache *cache ) override;
+  QNetworkConfiguration configuration() const override;
+  void setConfiguration( const QNetworkConfiguration &config ) override;
+
+protected:
+  void setEnabled( bool enabled ) override;
+
+private:
+  QNetworkAccessManager *m_manager = nullptr;
+};
+
+#endif // TESTNETWORKMANAGER_H
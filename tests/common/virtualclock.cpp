@@ -0,0 +1,70 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "virtualclock.h"
+
+#include <algorithm>
+
+VirtualClock::VirtualClock( QObject *parent )
+  : Clock{parent}
+{
+}
+
+qint64 VirtualClock::now() const
+{
+  return m_now.load();
+}
+
+void VirtualClock::advance( std::chrono::milliseconds step )
+{
+  const qint64 target = m_now.load() + std::max<qint64>( 0, step.count() );
+
+  // a timer may arm others while it expires, pick the earliest one each round
+  while ( !m_timers.isEmpty() && m_timers.firstKey() <= target ) {
+    const auto first = m_timers.begin();
+    ClockTimer *timer = first.value();
+    m_now.store( std::max( m_now.load(), first.key() ) );
+    m_timers.erase( first );
+    m_deadlines.remove( timer );
+    expire( timer );
+  }
+  m_now.store( target );
+}
+
+qint64 VirtualClock::nextDeadline() const
+{
+  return m_timers.isEmpty() ? -1 : m_timers.firstKey();
+}
+
+void VirtualClock::arm( ClockTimer *timer, qint64 deadline )
+{
+  disarm( timer );
+  m_timers.insert( deadline, timer );
+  m_deadlines.insert( timer, deadline );
+}
+
+void VirtualClock::disarm( ClockTimer *timer )
+{
+  const auto armed = m_deadlines.constFind( timer );
+  if ( armed == m_deadlines.constEnd() )
+    return;
+  m_timers.remove( armed.value(), timer );
+  m_deadlines.erase( armed );
+}
@@ -0,0 +1,61 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef VIRTUALCLOCK_H
+#define VIRTUALCLOCK_H
+
+#include "clock.h"
+
+#include <QHash>
+#include <QMultiMap>
+#include <atomic>
+
+/*!
+  Clock that only moves when the test advances it.
+
+  Timers armed on it expire in deadline order while advance() passes their
+  deadline, the time reads as the deadline of the timer being expired. Network
+  replies still arrive in real time, so a test advances in steps and lets the
+  event loop deliver the replies in between.
+*/
+class VirtualClock : public Clock
+{
+public:
+  explicit VirtualClock( QObject *parent = nullptr );
+
+  // may be called from any thread, the MockCloud reads it on its own
+  qint64 now() const override;
+
+  void advance( std::chrono::milliseconds step );
+
+  // deadline of the earliest armed timer, -1 if none is armed
+  qint64 nextDeadline() const;
+
+protected:
+  void arm( ClockTimer *timer, qint64 deadline ) override;
+  void disarm( ClockTimer *timer ) override;
+
+private:
+  std::atomic<qint64> m_now{ 0 };
+  QMultiMap<qint64, ClockTimer *> m_timers; // by deadline
+  QHash<ClockTimer *, qint64> m_deadlines;
+};
+
+#endif // VIRTUALCLOCK_H
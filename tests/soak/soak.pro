@@ -0,0 +1,6 @@
+TARGET = neatosoak
+TEMPLATE = app
+
+include(../common/common.pri)
+
+SOURCES += tst_soak.cpp
@@ -0,0 +1,249 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "testenvironment.h"
+#include "virtualclock.h"
+#include "pollscheduler.h"
+
+#include <QtTest>
+#include <QElapsedTimer>
+
+using namespace std::chrono_literals;
+
+/*!
+  Runs a few accounts for a day against a local cloud that hands out tokens
+  for an hour and fails some requests, while accounts are removed and added
+  again. Time is virtual: the scheduler, the accounts, their poll scheduler and
+  the token lifetime of the cloud run on a VirtualClock that is moved forward in
+  steps, each step waits only for the replies it caused. Afterwards no account,
+  reply or notable amount of memory may be left over. NEATO_SOAK_HOURS sets the
+  simulated length of the run, NEATO_SOAK_RSS_GROWTH_KB the memory growth
+  tolerated after the first hour.
+*/
+class NeatoSoak : public QObject
+{
+  Q_OBJECT
+private slots:
+  void initTestCase();
+
+  void accountsOverTime();
+
+private:
+  // runs the clock for duration, step by step, false if replies got stuck
+  bool run( std::chrono::milliseconds duration );
+  // replies arrive in real time, deliver them before the clock moves on
+  bool settle();
+
+  VirtualClock m_clock; // outlives everything running on it
+  TestEnvironment m_environment;
+  MockCloud::Config m_config;
+};
+
+namespace {
+  constexpr std::chrono::milliseconds step = 5s;
+  constexpr std::chrono::milliseconds warmUp = 1h;
+  constexpr std::chrono::milliseconds robotListInterval = 15min;
+  constexpr std::chrono::milliseconds mapsInterval = 1h;
+  constexpr std::chrono::milliseconds churnInterval = 2h;
+
+  constexpr int settleTimeoutMs = 10000;
+}
+
+void NeatoSoak::initTestCase()
+{
+  MockCloud::Config defaults;
+  defaults.robots = 5;
+  // real time only passes while waiting for replies
+  defaults.latencyMs = 0;
+  defaults.jitterMs = 2;
+  defaults.errorRate = 0.02;
+  defaults.tokenLifetimeSeconds = 3600;
+  m_config = TestEnvironment::configFromEnvironment( defaults );
+  QVERIFY( m_environment.start( m_config, m_clock ) );
+}
+
+bool NeatoSoak::run( std::chrono::milliseconds duration )
+{
+  const qint64 until = m_clock.now() + duration.count();
+  while ( m_clock.now() < until ) {
+    m_clock.advance( std::min( step, std::chrono::milliseconds( until - m_clock.now() ) ) );
+    if ( !settle() )
+      return false;
+  }
+  return true;
+}
+
+bool NeatoSoak::settle()
+{
+  // wakes the event loop up in case the last reply was delivered before waiting
+  QTimer wakeUp;
+  wakeUp.start( 50 );
+
+  QElapsedTimer waited;
+  waited.start();
+  while ( m_environment.scheduler().liveReplies() > 0 ) {
+    if ( waited.elapsed() > settleTimeoutMs )
+      return false;
+    QCoreApplication::processEvents( QEventLoop::WaitForMoreEvents );
+    QCoreApplication::sendPostedEvents( nullptr, QEvent::DeferredDelete );
+  }
+  // decoded bodies come back through queued calls
+  QCoreApplication::processEvents();
+  return true;
+}
+
+void NeatoSoak::accountsOverTime()
+{
+  const int hours = TestEnvironment::intFromEnvironment( "NEATO_SOAK_HOURS", 24 );
+  const int accountCount = TestEnvironment::intFromEnvironment( "NEATO_SOAK_ACCOUNTS", 3 );
+  const qint64 maxRssGrowthKb = TestEnvironment::intFromEnvironment( "NEATO_SOAK_RSS_GROWTH_KB", 2048 );
+  QVERIFY( hours > 1 );
+
+  int states = 0;
+  int failed = 0;
+  int shed = 0;
+  int mapLists = 0;
+  int replaced = 0;
+
+  // owns the accounts and the poll scheduler, everything connected to it stops with this function
+  QObject scope;
+  auto *polls = new PollScheduler( m_clock, &scope );
+
+  // all accounts see the same robots, so polls are keyed by account and serial
+  struct Route {
+    Neato *account;
+    QString serial;
+  };
+  QHash<QString, Route> routes;
+  QVector<Neato *> accounts;
+  int nextAccount = 0;
+
+  connect( polls, &PollScheduler::pollDue, &scope, [&routes]( const QString &key ) {
+    const auto route = routes.constFind( key );
+    if ( route != routes.constEnd() )
+      route->account->pollRobotState( route->serial );
+  });
+
+  auto addAccount = [&]() -> bool {
+    Neato *neato = m_environment.connectAccount( Neato::RateLimits(), &scope );
+    if ( !neato )
+      return false;
+
+    const QString prefix = QString::number( ++nextAccount ) + QLatin1Char('/');
+    for ( const Neato::Robot &robot : neato->robots() ) {
+      routes.insert( prefix + robot.serial, Route{ neato, robot.serial } );
+      polls->add( prefix + robot.serial );
+    }
+    connect( neato, &Neato::robotStateReceived, &scope, [polls, prefix, &states]( const QString &serial, const Neato::RobotState &state ) {
+      ++states;
+      polls->schedule( prefix + serial, state );
+    });
+    connect( neato, &Neato::robotStateFailed, &scope, [polls, prefix, &failed]( const QString &serial ) {
+      ++failed;
+      polls->scheduleRetry( prefix + serial );
+    });
+    connect( neato, &Neato::robotStatePollShed, &scope, [polls, prefix, &shed]( const QString &serial, qint64 retryInMs ) {
+      ++shed;
+      polls->scheduleIn( prefix + serial, std::chrono::milliseconds( retryInMs ) );
+    });
+
+    // the timers die with their account
+    auto *robotList = new ClockTimer( m_clock, neato );
+    connect( robotList, &ClockTimer::timeout, neato, &Neato::loadRobots );
+    robotList->start( robotListInterval );
+
+    auto *maps = new ClockTimer( m_clock, neato );
+    connect( maps, &ClockTimer::timeout, neato, [neato, &mapLists]() {
+      if ( neato->robots().isEmpty() )
+        return;
+      neato->loadMaps( neato->robots().first().serial, Neato::MapKind::Persistent, [&mapLists]( bool ok, const QVector<Neato::MapInfo> & ) {
+        if ( ok )
+          ++mapLists;
+      });
+    });
+    maps->start( mapsInterval );
+
+    accounts.append( neato );
+    return true;
+  };
+
+  auto removeAccount = [&]( Neato *neato ) {
+    for ( auto it = routes.begin(); it != routes.end(); ) {
+      if ( it->account != neato ) {
+        ++it;
+        continue;
+      }
+      polls->remove( it.key() );
+      it = routes.erase( it );
+    }
+    accounts.removeOne( neato );
+    delete neato;
+  };
+
+  for ( int i = 0; i < accountCount; ++i )
+    QVERIFY( addAccount() );
+
+  // let caches and connection pools settle before taking the baseline
+  QVERIFY( run( warmUp ) );
+  const qint64 baselineRss = TestEnvironment::residentSetSize();
+
+  QElapsedTimer realTime;
+  realTime.start();
+  const qint64 end = m_clock.now() + ( std::chrono::hours( hours ) - warmUp ).count();
+  while ( m_clock.now() < end ) {
+    QVERIFY( run( std::min( churnInterval, std::chrono::milliseconds( end - m_clock.now() ) ) ) );
+    if ( m_clock.now() >= end )
+      break;
+
+    // removed with requests in flight and possibly parked behind a token refresh
+    removeAccount( accounts.first() );
+    QVERIFY( addAccount() );
+    QCOMPARE( Neato::instanceCount(), accountCount );
+    ++replaced;
+  }
+  const qint64 finalRss = TestEnvironment::residentSetSize();
+
+  qInfo().noquote() << QStringLiteral("%1 h in %2 s: %3 states, %4 failed and %5 shed polls, %6 map lists, %7 accounts replaced")
+                       .arg( hours ).arg( realTime.elapsed() / 1000.0, 0, 'f', 1 ).arg( states ).arg( failed ).arg( shed ).arg( mapLists ).arg( replaced );
+  if ( const MockCloud *cloud = m_environment.cloud() ) {
+    qInfo().noquote() << QStringLiteral("cloud: %1 tokens issued, %2 injected failures, %3 rejected requests")
+                         .arg( cloud->tokensIssued() ).arg( cloud->failures() ).arg( cloud->rejected() );
+  }
+  qInfo().noquote() << QStringLiteral("RSS %1 kB after warm up, %2 kB at the end, peak %3 kB")
+                       .arg( baselineRss ).arg( finalRss ).arg( TestEnvironment::peakResidentSetSize() );
+
+  while ( !accounts.isEmpty() )
+    removeAccount( accounts.first() );
+  QCOMPARE( Neato::instanceCount(), 0 );
+  QVERIFY( settle() );
+
+  QVERIFY( states > 0 );
+  QVERIFY( mapLists > 0 );
+  if ( m_environment.cloud() ) {
+    // every account kept refreshing its token for the whole run
+    const quint64 refreshes = quint64( accountCount ) * quint64( hours * 3600 / m_config.tokenLifetimeSeconds - 1 );
+    QVERIFY2( m_environment.cloud()->tokensIssued() >= refreshes, qPrintable( QStringLiteral("%1 tokens issued").arg( m_environment.cloud()->tokensIssued() ) ) );
+  }
+  QVERIFY2( finalRss - baselineRss < maxRssGrowthKb, qPrintable( QStringLiteral("RSS grew by %1 kB").arg( finalRss - baselineRss ) ) );
+}
+
+QTEST_GUILESS_MAIN(NeatoSoak)
+
+#include "tst_soak.moc"
@@ -0,0 +1,67 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "tokenbucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+TokenBucket::TokenBucket( double perMinute, double capacity )
+{
+  configure( perMinute, capacity );
+  m_tokens = m_capacity;
+}
+
+void TokenBucket::configure( double perMinute, double capacity )
+{
+  m_perMs = std::max( perMinute, 1.0 ) / 60000.0;
+  m_capacity = std::max( capacity, 1.0 );
+  m_tokens = std::min( m_tokens, m_capacity );
+}
+
+double TokenBucket::tokensAt( qint64 now ) const
+{
+  if ( m_updatedAt < 0 )
+    return m_capacity;
+  return std::min( m_capacity, m_tokens + ( now - m_updatedAt ) * m_perMs );
+}
+
+qint64 TokenBucket::waitTime( qint64 now, double reserve ) const
+{
+  // a reserve the bucket can never exceed would block forever
+  const double needed = std::min( reserve, m_capacity - 1 ) + 1 - tokensAt( now );
+  if ( needed <= 0 )
+    return 0;
+  return static_cast<qint64>( std::ceil( needed / m_perMs ) );
+}
+
+void TokenBucket::take( qint64 now )
+{
+  // a drained bucket stays in debt until it refilled
+  const double tokens = tokensAt( now );
+  m_tokens = tokens < 0 ? tokens : std::max( 0.0, tokens - 1 );
+  m_updatedAt = now;
+}
+
+void TokenBucket::drainUntil( qint64 now, qint64 until )
+{
+  m_tokens = std::min( tokensAt( now ), 0.0 ) - std::max<qint64>( 0, until - now ) * m_perMs;
+  m_updatedAt = now;
+}
@@ -0,0 +1,58 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <QtGlobal>
+
+/*!
+  Token bucket refilled continuously at a fixed rate.
+
+  Time is passed in by the caller in milliseconds of a monotonic clock, the
+  bucket itself keeps no timer.
+*/
+class TokenBucket
+{
+public:
+  explicit TokenBucket( double perMinute = 60, double capacity = 10 );
+
+  // keeps the current fill level, clamped to the new capacity
+  void configure( double perMinute, double capacity );
+
+  // milliseconds until more than reserve tokens are available, 0 if that is the case now
+  qint64 waitTime( qint64 now, double reserve = 0 ) const;
+
+  // takes a token, never blocks, the bucket just stays empty if there was none
+  void take( qint64 now );
+
+  // empties the bucket so it only starts refilling at until, e.g. after the server reported the quota used up
+  void drainUntil( qint64 now, qint64 until );
+
+private:
+  double tokensAt( qint64 now ) const;
+
+  double m_perMs = 0;
+  double m_capacity = 0;
+  double m_tokens = 0;
+  qint64 m_updatedAt = -1;  // -1 until first used, the bucket starts full
+};
+
+#endif // TOKENBUCKET_H
@@ -0,0 +1,61 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "tracebuffer.h"
+
+#include <QMetaEnum>
+#include <QHash>
+
+quint32 TraceBuffer::hashSerial( const QString &robotSerial )
+{
+  // fixed seed, the same robot has the same hash across restarts
+  return static_cast<quint32>( qHash( robotSerial.toLower(), 0 ) );
+}
+
+void TraceBuffer::record( const Event &event )
+{
+  m_events[ m_next ] = event;
+  m_next = ( m_next + 1 ) % capacity;
+  if ( m_size < capacity )
+    ++m_size;
+}
+
+int TraceBuffer::size() const
+{
+  return static_cast<int>( m_size );
+}
+
+QStringList TraceBuffer::dump( qint64 now ) const
+{
+  const QMetaEnum endpoints = QMetaEnum::fromType<RequestMetrics::Endpoint>();
+  QStringList lines;
+  lines.reserve( size() );
+  for ( std::size_t i = 0; i < m_size; ++i ) {
+    const Event &e = m_events[ ( m_next + capacity - m_size + i ) % capacity ];
+    lines.append( QStringLiteral("#%1 %2s ago %3 robot %4 status %5 in %6ms")
+                  .arg( e.requestId )
+                  .arg( ( now - e.finishedAt ) / 1000 )
+                  .arg( QString::fromLatin1( endpoints.valueToKey( static_cast<int>(e.endpoint) ) ) )
+                  .arg( e.serialHash, 8, 16, QLatin1Char('0') )
+                  .arg( e.httpStatus )
+                  .arg( e.durationMs ) );
+  }
+  return lines;
+}
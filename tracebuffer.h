@@ -0,0 +1,64 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                         *
+ *  Copyright (C) 2024 Benjamin Zeller <zeller.benjamin@web.de>            *
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Lesser General Public             *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2.1 of the License, or (at your option) any later version.     *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Lesser General Public License for more details.                        *
+ *                                                                         *
+ *  You should have received a copy of the GNU Lesser General Public       *
+ *  License along with this library; If not, see                           *
+ *  <http://www.gnu.org/licenses/>.                                        *
+ *                                                                         *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TRACEBUFFER_H
+#define TRACEBUFFER_H
+
+#include "requestmetrics.h"
+
+#include <QStringList>
+#include <array>
+
+/*!
+  Fixed-size ring of the most recent requests of one Neato account.
+
+  Recording copies a few integers into a preallocated slot, so it can stay
+  enabled on every request. Nothing is formatted until the trace is dumped,
+  and no urls, tokens or serials are kept, robots are identified by a hash.
+*/
+class TraceBuffer
+{
+public:
+  struct Event {
+    quint32 requestId = 0;
+    qint64 finishedAt = 0;   // milliseconds on the account clock
+    quint32 durationMs = 0;
+    quint32 serialHash = 0;  // 0 for account wide requests
+    qint16 httpStatus = 0;   // 0 for network errors and timeouts
+    RequestMetrics::Endpoint endpoint = RequestMetrics::Endpoint::Token;
+  };
+
+  static constexpr std::size_t capacity = 256;
+
+  static quint32 hashSerial( const QString &robotSerial );
+
+  void record( const Event &event );
+  int size() const;
+
+  // one line per event, oldest first, ages relative to now
+  QStringList dump( qint64 now ) const;
+
+private:
+  std::array<Event, capacity> m_events{};
+  std::size_t m_next = 0;
+  std::size_t m_size = 0;
+};
+
+#endif // TRACEBUFFER_H